@@ -1,6 +1,8 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <memory>
+#include <cstdint>
 
 
 
@@ -17,21 +19,97 @@ struct AxisAllignedBox
 	glm::vec3 p2;
 };
 
+// flattened bvh node, same layout as BVHNode in raycommon.glsl
+// inner node: left_first is the left child, right child is left_first + 1, count is 0
+// leaf: triangles left_first .. left_first + count - 1
+struct BVHNode
+{
+	glm::vec3 box_min;
+	int left_first;
+	glm::vec3 box_max;
+	int count;
+};
+
+// 4 wide bvh node with child boxes quantized to 8 bits inside the node box, same layout as WideBVHNode in raycommon.glsl.
+// child box i on an axis is origin + (byte i of child_min / child_max) * 2^exponent
+struct WideBVHNode
+{
+	glm::vec3 origin;
+	uint32_t exponents;			// biased 8 bit exponents of x, y and z in the lowest three bytes, the top byte is the axis the children are sorted on
+	uint32_t child_min[3];		// one byte per child, per axis
+	uint32_t child_max[3];
+	int children[4];			// wide node index for inner children, first triangle for leaves
+	uint32_t child_info;		// one byte per child: 0 empty, 255 inner node, otherwise the leaf's triangle count
+	int parent;					// parent wide node * 4 + slot of this node in it, -1 for the root
+};
+
+// precomputed triangle for intersection, same layout as the vec4[3] records in raycommon.glsl
+struct TriangleRecord
+{
+	glm::vec3 v0;
+	uint32_t normal;			// octahedral encoded unit normal, two snorm16
+	glm::vec3 edge1;
+	uint32_t material;			// material id in the mesh
+	glm::vec3 edge2;
+	float padding2;
+};
+
+// object space geometry, shared by every trimesh that loaded the same file
+struct Mesh
+{
+	std::string filename = "";
+	std::vector<glm::vec3> vertices;
+	// vertices split into one array per axis and padded to a multiple of 4 with copies of the first vertex, for transform_mesh_bounds
+	std::vector<float> vertices_x, vertices_y, vertices_z;
+	std::vector<glm::ivec3> source_indices;		// triangles in file order
+	std::vector<glm::ivec3> indices;			// triangles in bvh leaf order, spatial splits can repeat a triangle
+
+	// material id of every triangle in file and in leaf order. id k > 0 is materials[k - 1] from the .mtl file,
+	// 0 is for faces before any usemtl and takes the material of the trimesh
+	std::vector<uint32_t> source_materials;
+	std::vector<uint32_t> triangle_materials;
+	std::string material_library = "";
+	std::vector<std::string> material_names;
+	std::vector<Material> materials;
+	std::vector<BVHNode> bvh;
+	std::vector<WideBVHNode> wide_bvh;
+
+	// build with spatial splits, slower but better for long thin triangles
+	bool spatial_splits = false;
+	// upload 16 bit positions quantized in box and 16 bit indices when there are few enough vertices,
+	// less than half the memory traffic of the float triangle records
+	bool quantized = false;
+
+	// hash of the obj file, 0 when it couldn't be read
+	uint64_t content_hash = 0;
+
+	AxisAllignedBox box;
+
+	// index in the mesh table, -1 when the mesh isn't uploaded
+	int slot = -1;
+	// index of materials[0] in the material table
+	int first_material = -1;
+};
+
+// an instance of a mesh
 struct TriMesh
 {
 	std::string name = "trimesh";
 	std::string filename = "";
-	std::vector<glm::vec3> vertices;
-	std::vector<glm::ivec3> indices;
-	std::vector<glm::vec3> transformed_vertices;
+	std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
 	Material material;
 
 	glm::mat4 transform = glm::identity<glm::mat4>();
+	glm::mat4 inverse_transform = glm::identity<glm::mat4>();
 	glm::vec3 translation = { 0, 0, 0 };
 	glm::vec3 rotation = { 0, 0, 0 };
 	glm::vec3 scale = { 1, 1, 1 };
 
+	// world space bounds
 	AxisAllignedBox box;
+
+	// index of material in the material table
+	int material_slot = -1;
 };
 
 struct Sphere
@@ -42,4 +120,6 @@ struct Sphere
 	
 	Material material;
 
+	// index of material in the material table
+	int material_slot = -1;
 };
\ No newline at end of file
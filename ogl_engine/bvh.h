@@ -0,0 +1,1605 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+#include <climits>
+#include <cassert>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <xmmintrin.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "Object.h"
+
+#define BVH_MAX_LEAF_SIZE 4
+// meshes with at least this many triangles use the parallel morton code builder
+#define LBVH_TRIANGLE_THRESHOLD 100000
+
+inline AxisAllignedBox empty_box()
+{
+	return { glm::vec3(INFINITY), glm::vec3(-INFINITY) };
+}
+
+inline void grow_box(AxisAllignedBox& box, const glm::vec3& p)
+{
+	box.p1 = glm::min(box.p1, p);
+	box.p2 = glm::max(box.p2, p);
+}
+
+inline void grow_box(AxisAllignedBox& box, const AxisAllignedBox& other)
+{
+	box.p1 = glm::min(box.p1, other.p1);
+	box.p2 = glm::max(box.p2, other.p2);
+}
+
+inline float surface_area(const AxisAllignedBox& box)
+{
+	glm::vec3 d = box.p2 - box.p1;
+	if (d.x < 0 || d.y < 0 || d.z < 0)
+		return 0.0f;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// top-down surface area heuristic build with a full sweep over sorted centroids on every axis.
+// boxes are the primitive bounds, order receives the primitive index for every leaf slot
+inline void build_bvh(const std::vector<AxisAllignedBox>& boxes, std::vector<BVHNode>& nodes, std::vector<int>& order, int max_leaf_size = BVH_MAX_LEAF_SIZE)
+{
+	nodes.clear();
+	order.resize(boxes.size());
+	std::iota(order.begin(), order.end(), 0);
+
+	if (boxes.empty())
+		return;
+
+	std::vector<glm::vec3> centroids(boxes.size());
+	for (size_t i = 0; i < boxes.size(); i++)
+		centroids[i] = (boxes[i].p1 + boxes[i].p2) * 0.5f;
+
+	nodes.reserve(boxes.size() * 2);
+	nodes.push_back({});
+
+	std::vector<int> sorted[3];
+	std::vector<float> right_area(boxes.size());
+
+	struct Task
+	{
+		int node;
+		int first;
+		int count;
+	};
+	std::vector<Task> tasks;
+	tasks.push_back({ 0, 0, (int)boxes.size() });
+
+	while (!tasks.empty())
+	{
+		Task task = tasks.back();
+		tasks.pop_back();
+
+		AxisAllignedBox bounds = empty_box();
+		for (int i = task.first; i < task.first + task.count; i++)
+			grow_box(bounds, boxes[order[i]]);
+
+		nodes[task.node].box_min = bounds.p1;
+		nodes[task.node].box_max = bounds.p2;
+		nodes[task.node].left_first = task.first;
+		nodes[task.node].count = task.count;
+
+		if (task.count <= 1)
+			continue;
+
+		float parent_area = surface_area(bounds);
+		float best_cost = INFINITY;
+		int best_axis = 0;
+		int best_split = task.count / 2;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			sorted[axis].assign(order.begin() + task.first, order.begin() + task.first + task.count);
+			std::sort(sorted[axis].begin(), sorted[axis].end(), [&](int a, int b) {
+				return centroids[a][axis] < centroids[b][axis];
+			});
+
+			AxisAllignedBox right = empty_box();
+			for (int i = task.count - 1; i > 0; i--)
+			{
+				grow_box(right, boxes[sorted[axis][i]]);
+				right_area[i] = surface_area(right);
+			}
+
+			AxisAllignedBox left = empty_box();
+			for (int i = 1; i < task.count; i++)
+			{
+				grow_box(left, boxes[sorted[axis][i - 1]]);
+				float cost = surface_area(left) * i + right_area[i] * (task.count - i);
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = i;
+				}
+			}
+		}
+
+		// traversal step costs as much as one triangle test
+		float split_cost = 1.0f + (parent_area > 0.0f ? best_cost / parent_area : (float)task.count);
+		if (task.count <= max_leaf_size && split_cost >= (float)task.count)
+			continue;
+
+		std::copy(sorted[best_axis].begin(), sorted[best_axis].end(), order.begin() + task.first);
+
+		int left_child = (int)nodes.size();
+		nodes.push_back({});
+		nodes.push_back({});
+		nodes[task.node].left_first = left_child;
+		nodes[task.node].count = 0;
+
+		tasks.push_back({ left_child + 1, task.first + best_split, task.count - best_split });
+		tasks.push_back({ left_child, task.first, best_split });
+	}
+}
+
+// one worker per core besides the calling thread, started once and kept waiting between runs,
+// so short jobs like the bounds of a dragged instance don't start threads every frame
+struct ThreadPool
+{
+	std::vector<std::thread> workers;
+	// one run at a time, a job must not start another run
+	std::mutex run_mutex;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::function<void(size_t)> job;
+	size_t job_count = 0;
+	size_t next_job = 0;
+	size_t finished_jobs = 0;
+	// counts runs, so a worker knows whether it has seen the current one
+	uint64_t generation = 0;
+	bool stopping = false;
+
+	ThreadPool()
+	{
+		unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned i = 1; i < thread_count; i++)
+			workers.emplace_back([this] { work(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	size_t thread_count() const
+	{
+		return workers.size() + 1;
+	}
+
+	// runs jobs of the current run until none are left, lock is held in between
+	void take_jobs(std::unique_lock<std::mutex>& lock)
+	{
+		while (next_job < job_count)
+		{
+			size_t i = next_job++;
+			lock.unlock();
+			job(i);
+			lock.lock();
+			if (++finished_jobs == job_count)
+				done.notify_all();
+		}
+	}
+
+	void work()
+	{
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+			take_jobs(lock);
+		}
+	}
+
+	// runs f(i) for every i in [0, count) on the workers and the calling thread, returns once all are done
+	void run(size_t count, std::function<void(size_t)> f)
+	{
+		std::lock_guard<std::mutex> run_lock(run_mutex);
+		std::unique_lock<std::mutex> lock(mutex);
+		job = std::move(f);
+		job_count = count;
+		next_job = 0;
+		finished_jobs = 0;
+		generation++;
+		wake.notify_all();
+
+		take_jobs(lock);
+		done.wait(lock, [&] { return finished_jobs == job_count; });
+		job = nullptr;
+	}
+};
+
+inline ThreadPool& thread_pool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+// runs f(begin, end) over [0, count) split across the thread pool
+template<class F>
+void parallel_for(size_t count, F f)
+{
+	ThreadPool& pool = thread_pool();
+	size_t thread_count = pool.thread_count();
+
+	if (count < 4096 || thread_count == 1)
+	{
+		f(size_t(0), count);
+		return;
+	}
+
+	size_t chunk = (count + thread_count - 1) / thread_count;
+	pool.run((count + chunk - 1) / chunk, [&](size_t i) {
+		f(i * chunk, std::min(i * chunk + chunk, count));
+	});
+}
+
+// spreads the lower 10 bits of v so there are two zero bits between each
+inline uint32_t expand_bits(uint32_t v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+inline uint32_t highest_bit(uint32_t v)
+{
+	uint32_t bit = 1u << 31;
+	while (!(v & bit))
+		bit >>= 1;
+	return bit;
+}
+
+inline uint32_t morton_code(glm::vec3 p)
+{
+	p = glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f));
+	return expand_bits((uint32_t)p.x) * 4 + expand_bits((uint32_t)p.y) * 2 + expand_bits((uint32_t)p.z);
+}
+
+// least significant digit radix sort of (code, primitive) pairs, 8 bits per pass
+inline void radix_sort(std::vector<uint32_t>& codes, std::vector<int>& values)
+{
+	std::vector<uint32_t> codes_tmp(codes.size());
+	std::vector<int> values_tmp(values.size());
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		size_t offsets[257] = {};
+		for (uint32_t code : codes)
+			offsets[((code >> shift) & 0xFF) + 1]++;
+
+		for (int i = 0; i < 256; i++)
+			offsets[i + 1] += offsets[i];
+
+		for (size_t i = 0; i < codes.size(); i++)
+		{
+			size_t dst = offsets[(codes[i] >> shift) & 0xFF]++;
+			codes_tmp[dst] = codes[i];
+			values_tmp[dst] = values[i];
+		}
+
+		codes.swap(codes_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+inline void update_node_bounds(std::vector<BVHNode>& nodes, const std::vector<AxisAllignedBox>& boxes, const std::vector<int>& order, int i)
+{
+	BVHNode& node = nodes[i];
+	AxisAllignedBox box = empty_box();
+
+	if (node.count > 0)
+	{
+		for (int p = node.left_first; p < node.left_first + node.count; p++)
+			grow_box(box, boxes[order[p]]);
+	}
+	else
+	{
+		grow_box(box, { nodes[node.left_first].box_min, nodes[node.left_first].box_max });
+		grow_box(box, { nodes[node.left_first + 1].box_min, nodes[node.left_first + 1].box_max });
+	}
+
+	node.box_min = box.p1;
+	node.box_max = box.p2;
+}
+
+inline float node_area(const BVHNode& node)
+{
+	return surface_area({ node.box_min, node.box_max });
+}
+
+// whether every inner node's box encloses the boxes of both its children
+inline bool bvh_bounds_enclose_children(const std::vector<BVHNode>& nodes)
+{
+	for (const BVHNode& node : nodes)
+	{
+		if (node.count > 0)
+			continue;
+
+		for (int c = 0; c < 2; c++)
+		{
+			const BVHNode& child = nodes[node.left_first + c];
+			if (glm::any(glm::lessThan(child.box_min, node.box_min)) || glm::any(glm::greaterThan(child.box_max, node.box_max)))
+				return false;
+		}
+	}
+	return true;
+}
+
+// tree rotations: swaps a child with one of its grandchildren when that shrinks the sibling's box.
+// the builders store children after their parent and a rotation at node i only moves records inside the
+// subtree of i, so walking backwards still sees every subtree before its root. a moved record keeps its
+// children, so afterwards children are no longer guaranteed to come after their parent
+inline void optimize_bvh_rotations(std::vector<BVHNode>& nodes, const std::vector<AxisAllignedBox>& boxes, const std::vector<int>& order)
+{
+	for (int i = (int)nodes.size() - 1; i >= 0; i--)
+	{
+		if (nodes[i].count > 0)
+			continue;
+
+		float best_area = INFINITY;
+		int best_child = -1;
+		int best_grandchild = -1;
+
+		for (int side = 0; side < 2; side++)
+		{
+			int child = nodes[i].left_first + side;
+			int sibling = nodes[i].left_first + 1 - side;
+			if (nodes[sibling].count > 0)
+				continue;
+
+			float area = node_area(nodes[sibling]);
+			for (int g = 0; g < 2; g++)
+			{
+				// swapping child with grandchild g leaves the child next to the other grandchild
+				const BVHNode& other = nodes[nodes[sibling].left_first + 1 - g];
+				AxisAllignedBox box = { other.box_min, other.box_max };
+				grow_box(box, { nodes[child].box_min, nodes[child].box_max });
+
+				float new_area = surface_area(box);
+				if (new_area < area && new_area < best_area)
+				{
+					best_area = new_area;
+					best_child = child;
+					best_grandchild = nodes[sibling].left_first + g;
+				}
+			}
+		}
+
+		if (best_child == -1)
+			continue;
+
+		std::swap(nodes[best_child], nodes[best_grandchild]);
+		int sibling = nodes[i].left_first + (best_child == nodes[i].left_first ? 1 : 0);
+		update_node_bounds(nodes, boxes, order, sibling);
+	}
+}
+
+// linear bvh: morton codes of the centroids are computed in parallel, radix sorted,
+// then every node splits where the highest differing code bit flips
+inline void build_lbvh(const std::vector<AxisAllignedBox>& boxes, std::vector<BVHNode>& nodes, std::vector<int>& order, int max_leaf_size = BVH_MAX_LEAF_SIZE)
+{
+	nodes.clear();
+	order.resize(boxes.size());
+	std::iota(order.begin(), order.end(), 0);
+
+	if (boxes.empty())
+		return;
+
+	AxisAllignedBox centroid_bounds = empty_box();
+	for (auto& box : boxes)
+		grow_box(centroid_bounds, (box.p1 + box.p2) * 0.5f);
+
+	glm::vec3 extent = centroid_bounds.p2 - centroid_bounds.p1;
+	glm::vec3 inv_extent = glm::vec3(
+		extent.x > 0 ? 1.0f / extent.x : 0.0f,
+		extent.y > 0 ? 1.0f / extent.y : 0.0f,
+		extent.z > 0 ? 1.0f / extent.z : 0.0f);
+
+	std::vector<uint32_t> codes(boxes.size());
+	parallel_for(boxes.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			glm::vec3 centroid = (boxes[i].p1 + boxes[i].p2) * 0.5f;
+			codes[i] = morton_code((centroid - centroid_bounds.p1) * inv_extent);
+		}
+	});
+
+	radix_sort(codes, order);
+
+	nodes.reserve(boxes.size() * 2);
+	nodes.push_back({});
+
+	struct Task
+	{
+		int node;
+		int first;
+		int count;
+	};
+	std::vector<Task> tasks;
+	tasks.push_back({ 0, 0, (int)boxes.size() });
+
+	while (!tasks.empty())
+	{
+		Task task = tasks.back();
+		tasks.pop_back();
+
+		nodes[task.node].left_first = task.first;
+		nodes[task.node].count = task.count;
+
+		if (task.count <= max_leaf_size)
+			continue;
+
+		int last = task.first + task.count - 1;
+		int split = task.first + task.count / 2;
+
+		uint32_t difference = codes[task.first] ^ codes[last];
+		if (difference)
+		{
+			// binary search for the first code that has the highest differing bit set
+			uint32_t bit = highest_bit(difference);
+			int low = task.first;
+			int high = last;
+			while (low + 1 < high)
+			{
+				int middle = (low + high) / 2;
+				if (codes[middle] & bit)
+					high = middle;
+				else
+					low = middle;
+			}
+			split = high;
+		}
+
+		int left_child = (int)nodes.size();
+		nodes.push_back({});
+		nodes.push_back({});
+		nodes[task.node].left_first = left_child;
+		nodes[task.node].count = 0;
+
+		tasks.push_back({ left_child + 1, split, last - split + 1 });
+		tasks.push_back({ left_child, task.first, split - task.first });
+	}
+
+	for (int i = (int)nodes.size() - 1; i >= 0; i--)
+		update_node_bounds(nodes, boxes, order, i);
+
+	optimize_bvh_rotations(nodes, boxes, order);
+	assert(bvh_bounds_enclose_children(nodes));
+}
+
+// bounds of the part of triangle (a, b, c) between the planes lo and hi on axis
+inline AxisAllignedBox clip_triangle(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, int axis, float lo, float hi)
+{
+	AxisAllignedBox box = empty_box();
+	const glm::vec3 v[3] = { a, b, c };
+
+	for (int i = 0; i < 3; i++)
+	{
+		const glm::vec3& p = v[i];
+		const glm::vec3& q = v[(i + 1) % 3];
+
+		if (p[axis] >= lo && p[axis] <= hi)
+			grow_box(box, p);
+
+		// edge crossings with both planes
+		for (float plane : { lo, hi })
+		{
+			if ((p[axis] < plane && q[axis] > plane) || (p[axis] > plane && q[axis] < plane))
+			{
+				float t = (plane - p[axis]) / (q[axis] - p[axis]);
+				glm::vec3 crossing = p + (q - p) * t;
+				crossing[axis] = plane;
+				grow_box(box, crossing);
+			}
+		}
+	}
+	return box;
+}
+
+inline AxisAllignedBox intersect_box(const AxisAllignedBox& a, const AxisAllignedBox& b)
+{
+	return { glm::max(a.p1, b.p1), glm::min(a.p2, b.p2) };
+}
+
+inline bool is_empty_box(const AxisAllignedBox& box)
+{
+	return box.p1.x > box.p2.x || box.p1.y > box.p2.y || box.p1.z > box.p2.z;
+}
+
+#define SBVH_BIN_COUNT 32
+// spatial splits are only tried when the children of the best object split overlap by more than this fraction of the root
+#define SBVH_OVERLAP_THRESHOLD 1e-5f
+// at most this many extra references per triangle in total
+#define SBVH_MAX_DUPLICATION 0.5f
+// spatial splits can keep every reference on both sides, so they stop below this depth
+#define SBVH_MAX_DEPTH 48
+
+// split bounding volume hierarchy: like build_bvh, but a node can also be split with a plane that cuts
+// straddling triangles in two references, each bounded by its own part of the triangle.
+// order receives the triangle index for every leaf slot and can hold a triangle more than once
+inline void build_sbvh(const std::vector<glm::vec3>& vertices, const std::vector<glm::ivec3>& triangles,
+	std::vector<BVHNode>& nodes, std::vector<int>& order, int max_leaf_size = BVH_MAX_LEAF_SIZE)
+{
+	nodes.clear();
+	order.clear();
+
+	if (triangles.empty())
+		return;
+
+	struct Reference
+	{
+		AxisAllignedBox box;
+		int triangle;
+	};
+
+	struct Task
+	{
+		int node;
+		int depth;
+		std::vector<Reference> references;
+	};
+
+	std::vector<Reference> root(triangles.size());
+	AxisAllignedBox root_box = empty_box();
+	for (size_t i = 0; i < triangles.size(); i++)
+	{
+		root[i].triangle = (int)i;
+		root[i].box = empty_box();
+		for (int k = 0; k < 3; k++)
+			grow_box(root[i].box, vertices[triangles[i][k]]);
+		grow_box(root_box, root[i].box);
+	}
+
+	float root_area = surface_area(root_box);
+	size_t max_references = triangles.size() + (size_t)(triangles.size() * SBVH_MAX_DUPLICATION);
+	size_t reference_count = triangles.size();
+
+	nodes.reserve(triangles.size() * 2);
+	nodes.push_back({});
+	order.reserve(max_references);
+
+	std::vector<Task> tasks;
+	tasks.push_back({ 0, 0, std::move(root) });
+
+	std::vector<float> right_area;
+
+	while (!tasks.empty())
+	{
+		Task task = std::move(tasks.back());
+		tasks.pop_back();
+
+		std::vector<Reference>& refs = task.references;
+		int count = (int)refs.size();
+
+		AxisAllignedBox bounds = empty_box();
+		for (auto& ref : refs)
+			grow_box(bounds, ref.box);
+
+		nodes[task.node].box_min = bounds.p1;
+		nodes[task.node].box_max = bounds.p2;
+
+		float parent_area = surface_area(bounds);
+
+		// object split, same sweep as build_bvh
+		float object_cost = INFINITY;
+		int object_axis = 0;
+		int object_split = count / 2;
+		AxisAllignedBox object_left, object_right;
+		right_area.resize(count);
+
+		for (int axis = 0; count > 1 && axis < 3; axis++)
+		{
+			std::sort(refs.begin(), refs.end(), [&](const Reference& a, const Reference& b) {
+				return a.box.p1[axis] + a.box.p2[axis] < b.box.p1[axis] + b.box.p2[axis];
+			});
+
+			std::vector<AxisAllignedBox> right_boxes(count);
+			AxisAllignedBox right = empty_box();
+			for (int i = count - 1; i > 0; i--)
+			{
+				grow_box(right, refs[i].box);
+				right_boxes[i] = right;
+				right_area[i] = surface_area(right);
+			}
+
+			AxisAllignedBox left = empty_box();
+			for (int i = 1; i < count; i++)
+			{
+				grow_box(left, refs[i - 1].box);
+				float cost = surface_area(left) * i + right_area[i] * (count - i);
+				if (cost < object_cost)
+				{
+					object_cost = cost;
+					object_axis = axis;
+					object_split = i;
+					object_left = left;
+					object_right = right_boxes[i];
+				}
+			}
+		}
+
+		// spatial split, binned along every axis of the node box
+		float spatial_cost = INFINITY;
+		int spatial_axis = 0;
+		float spatial_plane = 0.0f;
+		AxisAllignedBox spatial_left, spatial_right;
+		int spatial_left_count = 0, spatial_right_count = 0;
+
+		bool overlapping = count > 1 && task.depth < SBVH_MAX_DEPTH && root_area > 0.0f
+			&& surface_area(intersect_box(object_left, object_right)) / root_area > SBVH_OVERLAP_THRESHOLD;
+
+		for (int axis = 0; overlapping && axis < 3; axis++)
+		{
+			float lo = bounds.p1[axis];
+			float width = (bounds.p2[axis] - lo) / SBVH_BIN_COUNT;
+			if (width <= 0.0f)
+				continue;
+
+			AxisAllignedBox bins[SBVH_BIN_COUNT];
+			int enter[SBVH_BIN_COUNT] = {};
+			int exit[SBVH_BIN_COUNT] = {};
+			for (auto& bin : bins)
+				bin = empty_box();
+
+			for (auto& ref : refs)
+			{
+				int first = std::clamp((int)((ref.box.p1[axis] - lo) / width), 0, SBVH_BIN_COUNT - 1);
+				int last = std::clamp((int)((ref.box.p2[axis] - lo) / width), first, SBVH_BIN_COUNT - 1);
+
+				const glm::ivec3& t = triangles[ref.triangle];
+				for (int b = first; b <= last; b++)
+				{
+					AxisAllignedBox part = intersect_box(ref.box,
+						clip_triangle(vertices[t.x], vertices[t.y], vertices[t.z], axis, lo + width * b, lo + width * (b + 1)));
+					if (!is_empty_box(part))
+						grow_box(bins[b], part);
+				}
+				enter[first]++;
+				exit[last]++;
+			}
+
+			AxisAllignedBox right_boxes[SBVH_BIN_COUNT];
+			int right_counts[SBVH_BIN_COUNT];
+			AxisAllignedBox right = empty_box();
+			int right_count = 0;
+			for (int b = SBVH_BIN_COUNT - 1; b > 0; b--)
+			{
+				grow_box(right, bins[b]);
+				right_count += exit[b];
+				right_boxes[b] = right;
+				right_counts[b] = right_count;
+			}
+
+			AxisAllignedBox left = empty_box();
+			int left_count = 0;
+			for (int b = 1; b < SBVH_BIN_COUNT; b++)
+			{
+				grow_box(left, bins[b - 1]);
+				left_count += enter[b - 1];
+
+				if (left_count == 0 || right_counts[b] == 0)
+					continue;
+
+				if (reference_count + left_count + right_counts[b] - count > max_references)
+					continue;
+
+				float cost = surface_area(left) * left_count + surface_area(right_boxes[b]) * right_counts[b];
+				if (cost < spatial_cost)
+				{
+					spatial_cost = cost;
+					spatial_axis = axis;
+					spatial_plane = lo + width * b;
+					spatial_left = left;
+					spatial_right = right_boxes[b];
+					spatial_left_count = left_count;
+					spatial_right_count = right_counts[b];
+				}
+			}
+		}
+
+		bool spatial = spatial_cost < object_cost;
+		float best_cost = spatial ? spatial_cost : object_cost;
+
+		// traversal step costs as much as one triangle test
+		float split_cost = 1.0f + (parent_area > 0.0f ? best_cost / parent_area : (float)count);
+		if (count <= 1 || (count <= max_leaf_size && split_cost >= (float)count))
+		{
+			nodes[task.node].left_first = (int)order.size();
+			nodes[task.node].count = count;
+			for (auto& ref : refs)
+				order.push_back(ref.triangle);
+			continue;
+		}
+
+		std::vector<Reference> left_refs, right_refs;
+
+		if (spatial)
+		{
+			float left_box_area = surface_area(spatial_left);
+			float right_box_area = surface_area(spatial_right);
+			int left_count = spatial_left_count;
+			int right_count = spatial_right_count;
+
+			for (auto& ref : refs)
+			{
+				if (ref.box.p2[spatial_axis] <= spatial_plane)
+				{
+					left_refs.push_back(ref);
+					continue;
+				}
+				if (ref.box.p1[spatial_axis] >= spatial_plane)
+				{
+					right_refs.push_back(ref);
+					continue;
+				}
+
+				// reference unsplitting: keep the whole reference on one side when that is cheaper
+				AxisAllignedBox left_with = spatial_left;
+				AxisAllignedBox right_with = spatial_right;
+				grow_box(left_with, ref.box);
+				grow_box(right_with, ref.box);
+
+				float split = left_box_area * left_count + right_box_area * right_count;
+				float only_left = surface_area(left_with) * left_count + right_box_area * (right_count - 1);
+				float only_right = left_box_area * (left_count - 1) + surface_area(right_with) * right_count;
+
+				if (only_left < split && only_left <= only_right)
+				{
+					left_refs.push_back(ref);
+					right_count--;
+					continue;
+				}
+				if (only_right < split)
+				{
+					right_refs.push_back(ref);
+					left_count--;
+					continue;
+				}
+
+				const glm::ivec3& t = triangles[ref.triangle];
+				AxisAllignedBox left_part = intersect_box(ref.box,
+					clip_triangle(vertices[t.x], vertices[t.y], vertices[t.z], spatial_axis, -INFINITY, spatial_plane));
+				AxisAllignedBox right_part = intersect_box(ref.box,
+					clip_triangle(vertices[t.x], vertices[t.y], vertices[t.z], spatial_axis, spatial_plane, INFINITY));
+
+				if (!is_empty_box(left_part))
+					left_refs.push_back({ left_part, ref.triangle });
+				if (!is_empty_box(right_part))
+					right_refs.push_back({ right_part, ref.triangle });
+			}
+
+			// unsplitting or degenerate clips can still empty a side
+			if (left_refs.empty() || right_refs.empty())
+				spatial = false;
+			else
+				reference_count += left_refs.size() + right_refs.size() - count;
+		}
+
+		if (!spatial)
+		{
+			left_refs.clear();
+			right_refs.clear();
+			std::sort(refs.begin(), refs.end(), [&](const Reference& a, const Reference& b) {
+				return a.box.p1[object_axis] + a.box.p2[object_axis] < b.box.p1[object_axis] + b.box.p2[object_axis];
+			});
+			left_refs.assign(refs.begin(), refs.begin() + object_split);
+			right_refs.assign(refs.begin() + object_split, refs.end());
+		}
+
+		int left_child = (int)nodes.size();
+		nodes.push_back({});
+		nodes.push_back({});
+		nodes[task.node].left_first = left_child;
+		nodes[task.node].count = 0;
+
+		tasks.push_back({ left_child + 1, task.depth + 1, std::move(right_refs) });
+		tasks.push_back({ left_child, task.depth + 1, std::move(left_refs) });
+	}
+}
+
+// expected cost of a random ray in units of one triangle test, traversal steps cost the same
+inline float bvh_sah_cost(const std::vector<BVHNode>& nodes)
+{
+	if (nodes.empty())
+		return 0.0f;
+
+	float root_area = node_area(nodes[0]);
+	if (root_area <= 0.0f)
+		return 0.0f;
+
+	float cost = 0.0f;
+	for (auto& node : nodes)
+		cost += node_area(node) * (node.count > 0 ? (float)node.count : 1.0f);
+
+	return cost / root_area;
+}
+
+// entries of the per ray traversal stack in raycommon.glsl, deeper trees lose subtrees there
+#define BVH_STACK_SIZE 48
+
+// most entries the stack traversal of a binary bvh holds at once: the far child of every inner node
+// above the deepest leaf
+inline int bvh_stack_depth(const std::vector<BVHNode>& nodes)
+{
+	if (nodes.empty())
+		return 0;
+
+	int deepest = 0;
+	std::vector<std::pair<int, int>> walk = { { 0, 0 } };
+	while (!walk.empty())
+	{
+		auto [node, depth] = walk.back();
+		walk.pop_back();
+
+		if (nodes[node].count > 0)
+		{
+			deepest = std::max(deepest, depth);
+			continue;
+		}
+		walk.push_back({ nodes[node].left_first, depth + 1 });
+		walk.push_back({ nodes[node].left_first + 1, depth + 1 });
+	}
+	return deepest;
+}
+
+#define WIDE_BVH_INNER_NODE 255
+
+// quantizes the children boxes of wide node w to bytes relative to its own box, rounding outwards
+inline void quantize_wide_node(WideBVHNode& w, const AxisAllignedBox& box, const AxisAllignedBox* child_boxes, int child_count)
+{
+	w.origin = box.p1;
+	w.exponents = 0;
+
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = box.p2[axis] - box.p1[axis];
+		int exponent = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f)) : -126;
+		exponent = std::clamp(exponent, -126, 127);
+		while (exponent < 127 && std::ldexp(255.0f, exponent) < extent)
+			exponent++;
+
+		scale[axis] = std::ldexp(1.0f, exponent);
+		w.exponents |= uint32_t(exponent + 127) << (axis * 8);
+		w.child_min[axis] = 0;
+		w.child_max[axis] = 0;
+	}
+
+	for (int i = 0; i < child_count; i++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float low = std::floor((child_boxes[i].p1[axis] - box.p1[axis]) / scale[axis]);
+			float high = std::ceil((child_boxes[i].p2[axis] - box.p1[axis]) / scale[axis]);
+			w.child_min[axis] |= uint32_t(std::clamp(low, 0.0f, 255.0f)) << (i * 8);
+			w.child_max[axis] |= uint32_t(std::clamp(high, 0.0f, 255.0f)) << (i * 8);
+		}
+	}
+}
+
+// collapses a binary bvh into 4 wide nodes: every wide node takes the children of a binary node
+// and keeps opening its largest inner child until it has 4 children.
+// leaves must hold fewer than WIDE_BVH_INNER_NODE triangles
+inline void build_wide_bvh(const std::vector<BVHNode>& nodes, std::vector<WideBVHNode>& wide_nodes)
+{
+	wide_nodes.clear();
+	if (nodes.empty())
+		return;
+
+	struct Task
+	{
+		int wide;
+		int binary;		// binary node whose subtree the wide node covers
+		int parent;
+	};
+	std::vector<Task> tasks;
+	wide_nodes.push_back({});
+	tasks.push_back({ 0, 0, -1 });
+
+	while (!tasks.empty())
+	{
+		auto [wide, binary, parent] = tasks.back();
+		tasks.pop_back();
+
+		int children[4];
+		int child_count = 0;
+
+		if (nodes[binary].count > 0)
+		{
+			children[child_count++] = binary;
+		}
+		else
+		{
+			children[child_count++] = nodes[binary].left_first;
+			children[child_count++] = nodes[binary].left_first + 1;
+		}
+
+		while (child_count < 4)
+		{
+			int largest = -1;
+			float largest_area = -1.0f;
+			for (int i = 0; i < child_count; i++)
+			{
+				if (nodes[children[i]].count == 0 && node_area(nodes[children[i]]) > largest_area)
+				{
+					largest = i;
+					largest_area = node_area(nodes[children[i]]);
+				}
+			}
+
+			if (largest == -1)
+				break;
+
+			int opened = children[largest];
+			children[largest] = nodes[opened].left_first;
+			children[child_count++] = nodes[opened].left_first + 1;
+		}
+
+		// children go in slot order along the axis their centers spread the most,
+		// so traversal without sorting can visit them front to back from the ray direction
+		AxisAllignedBox centers = empty_box();
+		for (int i = 0; i < child_count; i++)
+			grow_box(centers, (nodes[children[i]].box_min + nodes[children[i]].box_max) * 0.5f);
+
+		glm::vec3 spread = centers.p2 - centers.p1;
+		int order_axis = spread.x >= spread.y && spread.x >= spread.z ? 0 : (spread.y >= spread.z ? 1 : 2);
+		std::sort(children, children + child_count, [&](int a, int b) {
+			return nodes[a].box_min[order_axis] + nodes[a].box_max[order_axis] < nodes[b].box_min[order_axis] + nodes[b].box_max[order_axis];
+		});
+
+		AxisAllignedBox child_boxes[4];
+		WideBVHNode w = {};
+		for (int i = 0; i < child_count; i++)
+		{
+			const BVHNode& child = nodes[children[i]];
+			child_boxes[i] = { child.box_min, child.box_max };
+
+			if (child.count > 0)
+			{
+				w.children[i] = child.left_first;
+				w.child_info |= uint32_t(child.count) << (i * 8);
+			}
+			else
+			{
+				w.children[i] = (int)wide_nodes.size();
+				w.child_info |= uint32_t(WIDE_BVH_INNER_NODE) << (i * 8);
+				wide_nodes.push_back({});
+				tasks.push_back({ w.children[i], children[i], wide * 4 + i });
+			}
+		}
+
+		quantize_wide_node(w, { nodes[binary].box_min, nodes[binary].box_max }, child_boxes, child_count);
+		w.exponents |= uint32_t(order_axis) << 24;
+		w.parent = parent;
+		wide_nodes[wide] = w;
+	}
+}
+
+// 16 bit positions for quantized meshes: a vertex is origin + q * scale with q in [0, QUANTIZED_POSITION_MAX] on every axis.
+// scale is a power of two and origin a multiple of it, so q * scale is exact and decoding gives the same float
+// on the cpu and the gpu. the bvh is built over the decoded positions and bounds exactly what the shader intersects
+#define QUANTIZED_POSITION_MAX 65535
+
+// how the triangles of an uploaded mesh are stored, same values as in raycommon.glsl
+#define GEOMETRY_FLOAT 0				// TriangleRecords
+#define GEOMETRY_QUANTIZED_16 1			// quantized vertices, 16 bit indices and material ids
+#define GEOMETRY_QUANTIZED_32 2			// quantized vertices, 32 bit indices and material ids
+
+inline void quantization_grid(const AxisAllignedBox& box, glm::vec3& origin, glm::vec3& scale)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = box.p2[axis] - box.p1[axis];
+		float magnitude = std::max(std::abs(box.p1[axis]), std::abs(box.p2[axis]));
+
+		// never finer than the float spacing of the coordinates, so origin / scale stays a small integer
+		int exponent = magnitude > 0.0f ? std::max(std::ilogb(magnitude) - 23, -126) : -126;
+		while (std::ldexp(float(QUANTIZED_POSITION_MAX - 1), exponent) < extent)
+			exponent++;
+
+		scale[axis] = std::ldexp(1.0f, exponent);
+		origin[axis] = std::floor(box.p1[axis] / scale[axis]) * scale[axis];
+	}
+}
+
+inline glm::uvec3 quantize_position(const glm::vec3& v, const glm::vec3& origin, const glm::vec3& scale)
+{
+	glm::vec3 q = glm::round((v - origin) / scale);
+	return glm::uvec3(glm::clamp(q, glm::vec3(0.0f), glm::vec3(float(QUANTIZED_POSITION_MAX))));
+}
+
+inline glm::vec3 dequantize_position(const glm::uvec3& q, const glm::vec3& origin, const glm::vec3& scale)
+{
+	return origin + glm::vec3(q) * scale;
+}
+
+// the vertices as the shader sees them
+inline void decoded_positions(const Mesh& mesh, std::vector<glm::vec3>& positions)
+{
+	if (!mesh.quantized)
+	{
+		positions = mesh.vertices;
+		return;
+	}
+
+	glm::vec3 origin, scale;
+	quantization_grid(mesh.box, origin, scale);
+
+	positions.resize(mesh.vertices.size());
+	for (size_t i = 0; i < mesh.vertices.size(); i++)
+		positions[i] = dequantize_position(quantize_position(mesh.vertices[i], origin, scale), origin, scale);
+}
+
+// appends the vertices and triangles of a quantized mesh to words and returns its format.
+// a vertex is two words, x | y << 16 and z. a triangle in leaf order is i0 | i1 << 16 and i2 | material << 16
+// when the indices and material ids fit in 16 bits, otherwise the four words i0, i1, i2 and material
+inline int build_quantized_geometry(const Mesh& mesh, std::vector<uint32_t>& words, int& first_vertex, int& first_triangle)
+{
+	glm::vec3 origin, scale;
+	quantization_grid(mesh.box, origin, scale);
+
+	first_vertex = (int)words.size();
+	for (auto& vertex : mesh.vertices)
+	{
+		glm::uvec3 q = quantize_position(vertex, origin, scale);
+		words.push_back(q.x | (q.y << 16));
+		words.push_back(q.z);
+	}
+
+	bool narrow = mesh.vertices.size() <= 65536 && mesh.material_names.size() < 65536;
+
+	first_triangle = (int)words.size();
+	for (size_t i = 0; i < mesh.indices.size(); i++)
+	{
+		glm::uvec3 index = glm::uvec3(mesh.indices[i]);
+		uint32_t material = mesh.triangle_materials.empty() ? 0 : mesh.triangle_materials[i];
+		if (narrow)
+		{
+			words.push_back(index.x | (index.y << 16));
+			words.push_back(index.z | (material << 16));
+		}
+		else
+		{
+			words.push_back(index.x);
+			words.push_back(index.y);
+			words.push_back(index.z);
+			words.push_back(material);
+		}
+	}
+	return narrow ? GEOMETRY_QUANTIZED_16 : GEOMETRY_QUANTIZED_32;
+}
+
+// most entries the stack traversal of a wide bvh holds at once: every wide node pushes all of its inner
+// children and pops one of them right away
+inline int wide_bvh_stack_depth(const std::vector<WideBVHNode>& nodes)
+{
+	if (nodes.empty())
+		return 0;
+
+	int deepest = 0;
+	std::vector<std::pair<int, int>> walk = { { 0, 0 } };
+	while (!walk.empty())
+	{
+		auto [node, stacked] = walk.back();
+		walk.pop_back();
+
+		int inner = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (((nodes[node].child_info >> (i * 8)) & 0xFF) == WIDE_BVH_INNER_NODE)
+				inner++;
+		}
+		deepest = std::max(deepest, stacked + inner);
+
+		for (int i = 0; i < 4; i++)
+		{
+			if (((nodes[node].child_info >> (i * 8)) & 0xFF) == WIDE_BVH_INNER_NODE)
+				walk.push_back({ nodes[node].children[i], stacked + inner - 1 });
+		}
+	}
+	return deepest;
+}
+
+// builds the bvh in object space and writes the triangles in leaf order to indices, so every leaf references a contiguous range
+inline void build_mesh_bvh(Mesh& mesh)
+{
+	mesh.box = empty_box();
+	for (auto& vertex : mesh.vertices)
+		grow_box(mesh.box, vertex);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<glm::vec3> positions;
+	decoded_positions(mesh, positions);
+
+	std::vector<int> order;
+	if (mesh.spatial_splits)
+	{
+		build_sbvh(positions, mesh.source_indices, mesh.bvh, order);
+	}
+	else
+	{
+		std::vector<AxisAllignedBox> boxes(mesh.source_indices.size());
+		for (size_t i = 0; i < mesh.source_indices.size(); i++)
+		{
+			boxes[i] = empty_box();
+			grow_box(boxes[i], positions[mesh.source_indices[i].x]);
+			grow_box(boxes[i], positions[mesh.source_indices[i].y]);
+			grow_box(boxes[i], positions[mesh.source_indices[i].z]);
+		}
+
+		if (boxes.size() >= LBVH_TRIANGLE_THRESHOLD)
+			build_lbvh(boxes, mesh.bvh, order);
+		else
+			build_bvh(boxes, mesh.bvh, order);
+	}
+
+	std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - start;
+	std::cout << "built " << (mesh.spatial_splits ? "sbvh" : "bvh") << " for " << mesh.filename << ": " << mesh.bvh.size() << " nodes, "
+		<< order.size() << " references, sah cost " << bvh_sah_cost(mesh.bvh) << ", " << build_time.count() << " ms\n";
+
+	build_wide_bvh(mesh.bvh, mesh.wide_bvh);
+
+	int stack_depth = wide_bvh_stack_depth(mesh.wide_bvh);
+	if (stack_depth > BVH_STACK_SIZE)
+	{
+		std::cout << "warning: bvh of " << mesh.filename << " needs " << stack_depth << " traversal stack entries, the shader has "
+			<< BVH_STACK_SIZE << " and will miss triangles\n";
+	}
+
+	mesh.indices.resize(order.size());
+	mesh.triangle_materials.resize(order.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		mesh.indices[i] = mesh.source_indices[order[i]];
+		mesh.triangle_materials[i] = mesh.source_materials.empty() ? 0 : mesh.source_materials[order[i]];
+	}
+}
+
+// the columns hold the decoded positions of quantized meshes, so instance bounds contain what the shader intersects
+inline void build_vertex_columns(Mesh& mesh)
+{
+	std::vector<glm::vec3> positions;
+	decoded_positions(mesh, positions);
+
+	size_t count = (positions.size() + 3) & ~size_t(3);
+	glm::vec3 pad = positions.empty() ? glm::vec3(0.0f) : positions[0];
+
+	mesh.vertices_x.resize(count);
+	mesh.vertices_y.resize(count);
+	mesh.vertices_z.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		glm::vec3 v = i < positions.size() ? positions[i] : pad;
+		mesh.vertices_x[i] = v.x;
+		mesh.vertices_y[i] = v.y;
+		mesh.vertices_z[i] = v.z;
+	}
+}
+
+// exact box of the mesh vertices under transform, four vertices per sse step and big meshes split across cores.
+// unlike transforming the corners of the object space box this stays tight for rotated instances
+inline AxisAllignedBox transform_mesh_bounds(const Mesh& mesh, const glm::mat4& transform)
+{
+	AxisAllignedBox result = empty_box();
+	if (mesh.vertices_x.empty())
+		return result;
+
+	std::mutex result_mutex;
+	parallel_for(mesh.vertices_x.size() / 4, [&](size_t begin, size_t end) {
+		__m128 row[3][4];
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 4; c++)
+				row[r][c] = _mm_set1_ps(transform[c][r]);
+		}
+
+		__m128 box_min[3], box_max[3];
+		for (int r = 0; r < 3; r++)
+		{
+			box_min[r] = _mm_set1_ps(INFINITY);
+			box_max[r] = _mm_set1_ps(-INFINITY);
+		}
+
+		for (size_t i = begin * 4; i < end * 4; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(&mesh.vertices_x[i]);
+			__m128 y = _mm_loadu_ps(&mesh.vertices_y[i]);
+			__m128 z = _mm_loadu_ps(&mesh.vertices_z[i]);
+			for (int r = 0; r < 3; r++)
+			{
+				__m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(row[r][0], x), _mm_mul_ps(row[r][1], y)),
+					_mm_add_ps(_mm_mul_ps(row[r][2], z), row[r][3]));
+				box_min[r] = _mm_min_ps(box_min[r], p);
+				box_max[r] = _mm_max_ps(box_max[r], p);
+			}
+		}
+
+		AxisAllignedBox chunk = empty_box();
+		for (int r = 0; r < 3; r++)
+		{
+			alignas(16) float lanes_min[4], lanes_max[4];
+			_mm_store_ps(lanes_min, box_min[r]);
+			_mm_store_ps(lanes_max, box_max[r]);
+			chunk.p1[r] = std::min(std::min(lanes_min[0], lanes_min[1]), std::min(lanes_min[2], lanes_min[3]));
+			chunk.p2[r] = std::max(std::max(lanes_max[0], lanes_max[1]), std::max(lanes_max[2], lanes_max[3]));
+		}
+
+		std::lock_guard<std::mutex> lock(result_mutex);
+		grow_box(result, chunk);
+	});
+	return result;
+}
+
+// full rebuild once the sah cost of a dynamic bvh grows this much over its last build
+#define DYNAMIC_BVH_REBUILD_RATIO 1.3f
+
+// bvh over single object leaves that can insert, remove and move leaves without rebuilding.
+// the layout stays the same as build_bvh's: node 0 is the root and the children of a node are a pair
+// starting at an odd index, so the gpu traversal doesn't change. leaf left_first is the object
+struct DynamicBVH
+{
+	std::vector<BVHNode> nodes;
+	std::vector<int> parents;
+	std::vector<int> free_pairs;
+	std::unordered_map<int, int> leaves;		// object -> leaf node
+
+	// sum of the areas of all nodes, the sah cost is this divided by the root area
+	float area_sum = 0.0f;
+	float built_cost = 0.0f;
+
+	// set while the tree is deeper than the shader's traversal stack, so the warning isn't repeated on every edit
+	bool too_deep = false;
+
+	// nodes[dirty_first .. dirty_last] changed since the last upload
+	int dirty_first = INT_MAX;
+	int dirty_last = -1;
+
+	void mark_dirty(int i)
+	{
+		dirty_first = std::min(dirty_first, i);
+		dirty_last = std::max(dirty_last, i);
+	}
+
+	void mark_all_dirty()
+	{
+		dirty_first = 0;
+		dirty_last = (int)nodes.size() - 1;
+	}
+
+	float sah_cost() const
+	{
+		float root_area = nodes.empty() ? 0.0f : node_area(nodes[0]);
+		return root_area > 0.0f ? area_sum / root_area : 0.0f;
+	}
+
+	void check_stack_depth()
+	{
+		int stack_depth = bvh_stack_depth(nodes);
+		if (stack_depth > BVH_STACK_SIZE && !too_deep)
+		{
+			std::cout << "warning: top level bvh needs " << stack_depth << " traversal stack entries, the shader has "
+				<< BVH_STACK_SIZE << " and will miss objects\n";
+		}
+		too_deep = stack_depth > BVH_STACK_SIZE;
+	}
+
+	bool contains(int object) const
+	{
+		return leaves.count(object) > 0;
+	}
+
+	void set_box(int i, const AxisAllignedBox& box)
+	{
+		area_sum += surface_area(box) - node_area(nodes[i]);
+		nodes[i].box_min = box.p1;
+		nodes[i].box_max = box.p2;
+		mark_dirty(i);
+	}
+
+	// copies node src to slot dst and fixes whatever pointed to src
+	void move_node(int src, int dst)
+	{
+		nodes[dst].box_min = nodes[src].box_min;
+		nodes[dst].box_max = nodes[src].box_max;
+		nodes[dst].left_first = nodes[src].left_first;
+		nodes[dst].count = nodes[src].count;
+		mark_dirty(dst);
+
+		if (nodes[dst].count > 0)
+		{
+			leaves[nodes[dst].left_first] = dst;
+		}
+		else
+		{
+			parents[nodes[dst].left_first] = dst;
+			parents[nodes[dst].left_first + 1] = dst;
+		}
+	}
+
+	// grows the boxes from node i up to the root, stops once a box doesn't change
+	void refit(int i)
+	{
+		for (; i != -1; i = parents[i])
+		{
+			if (nodes[i].count > 0)
+				continue;
+
+			AxisAllignedBox box = empty_box();
+			const BVHNode& left = nodes[nodes[i].left_first];
+			const BVHNode& right = nodes[nodes[i].left_first + 1];
+			grow_box(box, { left.box_min, left.box_max });
+			grow_box(box, { right.box_min, right.box_max });
+
+			if (box.p1 == nodes[i].box_min && box.p2 == nodes[i].box_max)
+				break;
+			set_box(i, box);
+		}
+	}
+
+	void rebuild_if_degraded()
+	{
+		if (sah_cost() > built_cost * DYNAMIC_BVH_REBUILD_RATIO)
+		{
+			std::vector<int> objects;
+			std::vector<AxisAllignedBox> boxes;
+			for (auto [object, leaf] : leaves)
+			{
+				objects.push_back(object);
+				boxes.push_back({ nodes[leaf].box_min, nodes[leaf].box_max });
+			}
+			rebuild(objects, boxes);
+		}
+	}
+
+	void rebuild(const std::vector<int>& objects, const std::vector<AxisAllignedBox>& boxes)
+	{
+		std::vector<int> order;
+		build_bvh(boxes, nodes, order, 1);
+
+		parents.assign(nodes.size(), -1);
+		free_pairs.clear();
+		leaves.clear();
+		area_sum = 0.0f;
+
+		for (int i = 0; i < (int)nodes.size(); i++)
+		{
+			area_sum += node_area(nodes[i]);
+			if (nodes[i].count > 0)
+			{
+				nodes[i].left_first = objects[order[nodes[i].left_first]];
+				leaves[nodes[i].left_first] = i;
+			}
+			else
+			{
+				parents[nodes[i].left_first] = i;
+				parents[nodes[i].left_first + 1] = i;
+			}
+		}
+
+		built_cost = sah_cost();
+		mark_all_dirty();
+		check_stack_depth();
+	}
+
+	void insert(int object, const AxisAllignedBox& box)
+	{
+		BVHNode leaf = { box.p1, object, box.p2, 1 };
+
+		if (nodes.empty())
+		{
+			nodes.push_back(leaf);
+			parents.push_back(-1);
+			leaves[object] = 0;
+			area_sum = surface_area(box);
+			built_cost = sah_cost();
+			mark_all_dirty();
+			return;
+		}
+
+		// walks down to the sibling with the lowest area increase over its ancestors
+		int sibling = 0;
+		float inherited = 0.0f;
+		while (nodes[sibling].count == 0)
+		{
+			AxisAllignedBox combined = { nodes[sibling].box_min, nodes[sibling].box_max };
+			grow_box(combined, box);
+			float combined_area = surface_area(combined);
+
+			float here = combined_area + inherited;
+			inherited += combined_area - node_area(nodes[sibling]);
+
+			float child_cost[2];
+			for (int c = 0; c < 2; c++)
+			{
+				const BVHNode& child = nodes[nodes[sibling].left_first + c];
+				AxisAllignedBox child_box = { child.box_min, child.box_max };
+				grow_box(child_box, box);
+				child_cost[c] = surface_area(child_box) + inherited - (child.count > 0 ? 0.0f : node_area(child));
+			}
+
+			if (here <= child_cost[0] && here <= child_cost[1])
+				break;
+			sibling = nodes[sibling].left_first + (child_cost[1] < child_cost[0] ? 1 : 0);
+		}
+
+		int pair;
+		if (!free_pairs.empty())
+		{
+			pair = free_pairs.back();
+			free_pairs.pop_back();
+		}
+		else
+		{
+			pair = (int)nodes.size();
+			nodes.resize(nodes.size() + 2);
+			parents.resize(parents.size() + 2);
+		}
+
+		// the sibling moves down to the new pair and its slot becomes their parent
+		move_node(sibling, pair);
+		parents[pair] = sibling;
+
+		nodes[pair + 1] = leaf;
+		parents[pair + 1] = sibling;
+		leaves[object] = pair + 1;
+		mark_dirty(pair + 1);
+		area_sum += surface_area(box);
+
+		AxisAllignedBox combined = { nodes[pair].box_min, nodes[pair].box_max };
+		grow_box(combined, box);
+		nodes[sibling].count = 0;
+		nodes[sibling].left_first = pair;
+		nodes[sibling].box_min = nodes[sibling].box_max = glm::vec3(0.0f);
+		set_box(sibling, combined);
+		refit(parents[sibling]);
+
+		rebuild_if_degraded();
+		check_stack_depth();
+	}
+
+	void remove(int object)
+	{
+		auto it = leaves.find(object);
+		if (it == leaves.end())
+			return;
+
+		int leaf = it->second;
+		leaves.erase(it);
+
+		if (leaf == 0)
+		{
+			nodes.clear();
+			parents.clear();
+			free_pairs.clear();
+			area_sum = 0.0f;
+			built_cost = 0.0f;
+			mark_all_dirty();
+			return;
+		}
+
+		// the sibling takes the place of the parent
+		int parent = parents[leaf];
+		int pair = nodes[parent].left_first;
+		int sibling = leaf == pair ? pair + 1 : pair;
+
+		area_sum -= node_area(nodes[leaf]) + node_area(nodes[parent]);
+		move_node(sibling, parent);
+		free_pairs.push_back(pair);
+		refit(parents[parent]);
+
+		rebuild_if_degraded();
+	}
+
+	void move(int object, const AxisAllignedBox& box)
+	{
+		auto it = leaves.find(object);
+		if (it == leaves.end())
+			return;
+
+		set_box(it->second, box);
+		refit(parents[it->second]);
+
+		rebuild_if_degraded();
+	}
+
+	// gives the leaf of object a new object index, the tree doesn't change
+	void rename(int object, int new_object)
+	{
+		auto it = leaves.find(object);
+		if (it == leaves.end())
+			return;
+
+		int leaf = it->second;
+		leaves.erase(it);
+		leaves[new_object] = leaf;
+		nodes[leaf].left_first = new_object;
+		mark_dirty(leaf);
+	}
+};
+
+// octahedral mapping of a unit vector to two 16 bit snorms, decoded by unpack_normal in raycommon.glsl
+inline uint32_t pack_normal(glm::vec3 n)
+{
+	float length = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (length == 0.0f)
+		return glm::packSnorm2x16(glm::vec2(0.0f));
+
+	glm::vec2 p = glm::vec2(n.x, n.y) / length;
+	if (n.z < 0.0f)
+	{
+		glm::vec2 flipped = glm::vec2(1.0f - std::abs(p.y), 1.0f - std::abs(p.x));
+		p = glm::vec2(p.x >= 0.0f ? flipped.x : -flipped.x, p.y >= 0.0f ? flipped.y : -flipped.y);
+	}
+	return glm::packSnorm2x16(p);
+}
+
+// appends the triangles in bvh leaf order as a vertex, two edges, the face normal and the material id
+inline void build_triangle_records(const Mesh& mesh, std::vector<TriangleRecord>& records)
+{
+	size_t first = records.size();
+	records.resize(first + mesh.indices.size());
+	for (size_t i = 0; i < mesh.indices.size(); i++)
+	{
+		glm::vec3 a = mesh.vertices[mesh.indices[i].x];
+		glm::vec3 b = mesh.vertices[mesh.indices[i].y];
+		glm::vec3 c = mesh.vertices[mesh.indices[i].z];
+
+		TriangleRecord& record = records[first + i];
+		record.v0 = a;
+		record.edge1 = b - a;
+		record.edge2 = c - a;
+		record.normal = pack_normal(glm::cross(record.edge1, record.edge2));
+		record.material = mesh.triangle_materials.empty() ? 0 : mesh.triangle_materials[i];
+		record.padding2 = 0.0f;
+	}
+}
+
+// appends the wide bvh of mesh to a pool shared by several meshes, with child and parent links
+// moved from mesh local indices to pool indices. first_triangle is where the mesh's triangles start in their pool
+inline void append_wide_bvh(const Mesh& mesh, int first_triangle, std::vector<WideBVHNode>& nodes)
+{
+	int first_node = (int)nodes.size();
+	nodes.insert(nodes.end(), mesh.wide_bvh.begin(), mesh.wide_bvh.end());
+
+	for (size_t n = first_node; n < nodes.size(); n++)
+	{
+		WideBVHNode& node = nodes[n];
+		for (int i = 0; i < 4; i++)
+		{
+			uint32_t info = (node.child_info >> (i * 8)) & 0xFF;
+			if (info == WIDE_BVH_INNER_NODE)
+				node.children[i] += first_node;
+			else if (info != 0)
+				node.children[i] += first_triangle;
+		}
+		if (node.parent >= 0)
+			node.parent += first_node * 4;
+	}
+}
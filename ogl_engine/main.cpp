@@ -9,6 +9,12 @@
 #include "rendering/vao.h"
 #include "rendering/vbo.h"
 #include "rendering/ebo.h"
+#include "rendering/gputimer.h"
+#include "rendering/gpucounter.h"
+#include "rendering/uploadring.h"
+#include "rendering/shadervariants.h"
+#include "rendering/wavefront.h"
+#include "rendering/denoiser.h"
 
 #include <glm/glm.hpp>
 #include <glm/matrix.hpp>
@@ -28,13 +34,26 @@
 #include "imgui_impl_opengl3.h"
 
 #include "Object.h"
+#include "bvh.h"
 #include <filesystem>
 
 
-#define MAX_VERTEX_COUNT 5000
-#define MAX_TRIMESH_COUNT 5
-#define MAX_INDICES_COUNT 5000
-#define MAX_SPHERE_COUNT 100
+// staging bytes per frame for object and top level updates, bigger writes go to their buffer directly
+#define UPLOAD_RING_FRAME_SIZE (1 << 20)
+// linked specializations of the ray shader kept around for switching back and forth between settings
+#define RAY_SHADER_VARIANT_COUNT 8
+// the compute ray pass traces one tile per work group, same values as in rayCompute.comp
+#define RAY_TILE_SIZE 8
+#define TILE_ORDER_ROWS 0
+#define TILE_ORDER_STRIPS 1
+#define RAY_BACKEND_FRAGMENT 0
+#define RAY_BACKEND_COMPUTE 1
+#define RAY_BACKEND_WAVEFRONT 2
+#define RAY_BACKEND_COUNT 3
+// same as in raycommon.glsl
+#define OCCUPANCY_MAX_BOUNCES 16
+// same as in frameparams.glsl, no pixel converges before this many frames
+#define ADAPTIVE_MIN_FRAMES 16
 
 bool is_key_pressed(GLFWwindow* window, int key)
 {
@@ -93,139 +112,430 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 
 
 
-void updateTriMeshes(GLuint trimeshBufferID, std::vector<TriMesh>& trimeshes)
+// makes buffer hold at least size bytes, growing to twice its size so adding objects one by one doesn't reallocate every time.
+// returns true when the buffer was reallocated, its old contents are gone then
+bool growBuffer(GLuint buffer, size_t size)
 {
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, trimeshBufferID);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
 
+    GLint buffer_size = 0;
+    glGetBufferParameteriv(GL_SHADER_STORAGE_BUFFER, GL_BUFFER_SIZE, &buffer_size);
+    if (buffer_size > 0 && size <= static_cast<size_t>(buffer_size))
+        return false;
 
+    size_t new_size = std::max(std::max(size, 2 * (size_t)buffer_size), (size_t)256);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, new_size, nullptr, GL_DYNAMIC_DRAW);
+    return true;
+}
 
-    int trimesh_size = sizeof(glm::vec3) * MAX_VERTEX_COUNT
-        + sizeof(glm::ivec3) * MAX_INDICES_COUNT
-        + sizeof(glm::vec3)
-        + sizeof(glm::vec4)
-        + sizeof(float)
-        + sizeof(AxisAllignedBox);
-       
-
-    int padding = trimesh_size % 16;
-    if (padding)
+// same layout as MeshInfo in raycommon.glsl
+struct MeshInfo
+{
+    int first_triangle;
+    int triangle_count;
+    int first_node;
+    int node_count;
+    int first_material;
+    int format;
+    int first_vertex;
+    glm::vec3 origin;
+    glm::vec3 scale;
+};
+
+// packs the geometry of every distinct mesh once into the triangle and node pools, trimeshes sharing a mesh share its slot.
+// the pools only hold what the scene uses, so their size follows the loaded meshes.
+// the .mtl materials of the meshes come first in the material table, updateMaterials uploads them
+void updateMeshes(GLuint meshBufferID, GLuint trianglePoolBufferID, GLuint nodePoolBufferID, GLuint quantizedPoolBufferID, std::vector<TriMesh>& trimeshes)
+{
+    for (auto& trimesh : trimeshes)
+        trimesh.mesh->slot = -1;
+
+    int material_count = 0;
+    std::vector<MeshInfo> infos;
+    std::vector<TriangleRecord> triangles;
+    std::vector<WideBVHNode> nodes;
+    std::vector<uint32_t> quantized;
+    for (auto& trimesh : trimeshes)
     {
-        padding = 16 - padding;
+        Mesh& mesh = *trimesh.mesh;
+        if (mesh.slot != -1 || mesh.indices.empty())
+            continue;
+
+        mesh.slot = infos.size();
+        mesh.first_material = material_count;
+        material_count += mesh.materials.size();
+
+        MeshInfo info;
+        info.triangle_count = mesh.indices.size();
+        info.first_node = nodes.size();
+        info.node_count = mesh.wide_bvh.size();
+        info.first_material = mesh.first_material;
+        info.origin = glm::vec3(0.0f);
+        info.scale = glm::vec3(0.0f);
+
+        // leaves of quantized meshes keep triangle numbers in the mesh, the shader adds the word offset itself
+        if (mesh.quantized)
+        {
+            info.format = build_quantized_geometry(mesh, quantized, info.first_vertex, info.first_triangle);
+            quantization_grid(mesh.box, info.origin, info.scale);
+            append_wide_bvh(mesh, 0, nodes);
+        }
+        else
+        {
+            info.format = GEOMETRY_FLOAT;
+            info.first_vertex = 0;
+            info.first_triangle = triangles.size();
+            build_triangle_records(mesh, triangles);
+            append_wide_bvh(mesh, info.first_triangle, nodes);
+        }
+        infos.push_back(info);
     }
-    padding = 0;
-    trimesh_size += padding;
-        
-    
-    for (int i = 0; i < trimeshes.size(); i++)
+
+    growBuffer(meshBufferID, sizeof(MeshInfo) * infos.size());
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(MeshInfo) * infos.size(), infos.data());
+
+    growBuffer(trianglePoolBufferID, sizeof(TriangleRecord) * triangles.size());
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(TriangleRecord) * triangles.size(), triangles.data());
+
+    growBuffer(nodePoolBufferID, sizeof(WideBVHNode) * nodes.size());
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(WideBVHNode) * nodes.size(), nodes.data());
+
+    growBuffer(quantizedPoolBufferID, sizeof(uint32_t) * quantized.size());
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint32_t) * quantized.size(), quantized.data());
+
+    std::cout << "mesh pools: " << infos.size() << " meshes, " << triangles.size() << " float triangles ("
+        << sizeof(TriangleRecord) * triangles.size() / 1024 << " KB), " << sizeof(uint32_t) * quantized.size() / 1024 << " KB quantized geometry, "
+        << nodes.size() << " nodes (" << sizeof(WideBVHNode) * nodes.size() / 1024 << " KB)\n";
+}
+
+// Material is uploaded as it is, same layout as _Material in raycommon.glsl
+static_assert(sizeof(Material) == 32, "Material has to match _Material");
+
+// material table: the .mtl materials of every uploaded mesh, then one material per trimesh, then one per sphere.
+// slots move when objects are added or removed, the trimeshes and spheres have to be uploaded again after it
+void updateMaterials(UploadRing& uploads, GLuint materialBufferID, std::vector<Sphere>& spheres, std::vector<TriMesh>& trimeshes)
+{
+    std::vector<Material> table;
+    for (auto& trimesh : trimeshes)
     {
- 
-        glm::mat4 scale = glm::scale(glm::identity<glm::mat4>(), trimeshes[i].scale);
-        glm::mat4 rotation = glm::rotate(glm::identity<glm::mat4>(), trimeshes[i].rotation.x, { 1.0, 0.0, 0.0 })
-                * glm::rotate(glm::identity<glm::mat4>(), trimeshes[i].rotation.y, { 0.0, 1.0, 0.0 })
-                * glm::rotate(glm::identity<glm::mat4>(), trimeshes[i].rotation.z, { 1.0, 0.0, 1.0 });
+        Mesh& mesh = *trimesh.mesh;
+        if (mesh.slot == -1)
+            continue;
 
-        glm::mat4 translate = glm::translate(glm::identity<glm::mat4>(), trimeshes[i].translation);
-        trimeshes[i].transform = translate * rotation * scale;
+        table.resize(std::max(table.size(), mesh.first_material + mesh.materials.size()));
+        std::copy(mesh.materials.begin(), mesh.materials.end(), table.begin() + mesh.first_material);
+    }
 
-        glm::vec3 near = { INFINITY, INFINITY, INFINITY };
-        glm::vec3 far = {-INFINITY, -INFINITY, -INFINITY };
+    for (auto& trimesh : trimeshes)
+    {
+        trimesh.material_slot = table.size();
+        table.push_back(trimesh.material);
+    }
 
-        trimeshes[i].transformed_vertices.clear();
+    for (auto& sphere : spheres)
+    {
+        sphere.material_slot = table.size();
+        table.push_back(sphere.material);
+    }
 
-        for (auto& vertex : trimeshes[i].vertices)
-        {
-            glm::vec3 transformed_vertex = trimeshes[i].transform * glm::vec4(vertex, 1.0f);
+    growBuffer(materialBufferID, sizeof(Material) * table.size());
+    uploads.Write(materialBufferID, 0, sizeof(Material) * table.size(), table.data());
+}
 
-            trimeshes[i].transformed_vertices.push_back(transformed_vertex);
+// same layout as Instance in raycommon.glsl
+struct InstanceData
+{
+    glm::mat4 transform;
+    glm::mat4 inverse_transform;
+    int mesh;
+    int material;
+    int padding[2];
+};
+
+void calculateTransform(TriMesh& trimesh)
+{
+    glm::mat4 scale = glm::scale(glm::identity<glm::mat4>(), trimesh.scale);
+    glm::mat4 rotation = glm::rotate(glm::identity<glm::mat4>(), trimesh.rotation.x, { 1.0, 0.0, 0.0 })
+            * glm::rotate(glm::identity<glm::mat4>(), trimesh.rotation.y, { 0.0, 1.0, 0.0 })
+            * glm::rotate(glm::identity<glm::mat4>(), trimesh.rotation.z, { 1.0, 0.0, 1.0 });
+
+    glm::mat4 translate = glm::translate(glm::identity<glm::mat4>(), trimesh.translation);
+    trimesh.transform = translate * rotation * scale;
+    trimesh.inverse_transform = glm::inverse(trimesh.transform);
+    trimesh.box = transform_mesh_bounds(*trimesh.mesh, trimesh.transform);
+}
 
-            near.x = std::min(transformed_vertex.x, near.x);
-            near.y = std::min(transformed_vertex.y, near.y);
-            near.z = std::min(transformed_vertex.z, near.z);
+// moving an instance only uploads its two matrices
+void updateTriMeshTransform(UploadRing& uploads, GLuint instanceBufferID, std::vector<TriMesh>& trimeshes, int i)
+{
+    calculateTransform(trimeshes[i]);
 
-            far.x = std::max(transformed_vertex.x, far.x);
-            far.y = std::max(transformed_vertex.y, far.y);
-            far.z = std::max(transformed_vertex.z, far.z);
+    uploads.Write(instanceBufferID, i * sizeof(InstanceData) + offsetof(InstanceData, transform),
+        sizeof(glm::mat4) * 2, &trimeshes[i].transform);
+}
 
+void updateTriMeshMaterial(UploadRing& uploads, GLuint materialBufferID, std::vector<TriMesh>& trimeshes, int i)
+{
+    uploads.Write(materialBufferID, trimeshes[i].material_slot * sizeof(Material), sizeof(Material), &trimeshes[i].material);
+}
 
-        }
-      
+void updateTriMesh(UploadRing& uploads, GLuint instanceBufferID, std::vector<TriMesh>& trimeshes, int i)
+{
+    calculateTransform(trimeshes[i]);
 
-        trimeshes[i].box.p1 = near;
-        trimeshes[i].box.p2 = far;
+    InstanceData instance;
+    instance.transform = trimeshes[i].transform;
+    instance.inverse_transform = trimeshes[i].inverse_transform;
+    instance.mesh = trimeshes[i].mesh->slot;
+    instance.material = trimeshes[i].material_slot;
 
+    uploads.Write(instanceBufferID, i * sizeof(InstanceData), sizeof(InstanceData), &instance);
+}
 
-        
+void updateTriMeshes(UploadRing& uploads, GLuint instanceBufferID, std::vector<TriMesh>& trimeshes)
+{
+    growBuffer(instanceBufferID, sizeof(InstanceData) * trimeshes.size());
+    for (int i = 0; i < trimeshes.size(); i++)
+        updateTriMesh(uploads, instanceBufferID, trimeshes, i);
+}
 
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * trimesh_size,
-            sizeof(glm::vec3) * trimeshes[i].transformed_vertices.size(), trimeshes[i].transformed_vertices.data());
-
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * trimesh_size + sizeof(glm::vec3) * MAX_VERTEX_COUNT,
-            sizeof(glm::ivec3) * trimeshes[i].indices.size(), trimeshes[i].indices.data());
-
-
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * trimesh_size + sizeof(glm::vec3) * MAX_VERTEX_COUNT
-            + sizeof(glm::ivec3) * MAX_INDICES_COUNT, sizeof(glm::vec3), &trimeshes[i].material.color);
-
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * trimesh_size + sizeof(glm::vec3) * MAX_VERTEX_COUNT
-            + sizeof(glm::ivec3) * MAX_INDICES_COUNT
-            + sizeof(glm::vec3),
-
-            sizeof(glm::vec4), &trimeshes[i].material.emission);
-
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * trimesh_size + sizeof(glm::vec3) * MAX_VERTEX_COUNT
-            + sizeof(glm::ivec3) * MAX_INDICES_COUNT
-            + sizeof(glm::vec3)
-            + sizeof(glm::vec4),
-            sizeof(float), &trimeshes[i].material.reflection);
-        /*
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * trimesh_size + sizeof(glm::vec3) * MAX_VERTEX_COUNT
-            + sizeof(glm::ivec3) * MAX_INDICES_COUNT
-            + sizeof(glm::vec3)
-            + sizeof(glm::vec4)
-            + sizeof(float),
-            sizeof(float[4][4]), &trimeshes[i].transform);*/
-
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * trimesh_size + sizeof(glm::vec3) * MAX_VERTEX_COUNT
-            + sizeof(glm::ivec3) * MAX_INDICES_COUNT
-            + sizeof(glm::vec3)
-            + sizeof(glm::vec4)
-            + sizeof(float),
-            sizeof(AxisAllignedBox), &trimeshes[i].box);
-   
-    }
+// uploads a newly added trimesh i, all of them when the instance buffer had to grow for it
+void addTriMesh(UploadRing& uploads, GLuint instanceBufferID, std::vector<TriMesh>& trimeshes, int i)
+{
+    if (growBuffer(instanceBufferID, sizeof(InstanceData) * trimeshes.size()))
+        updateTriMeshes(uploads, instanceBufferID, trimeshes);
+    else
+        updateTriMesh(uploads, instanceBufferID, trimeshes, i);
 }
 
 
-void updateSpheres(GLuint sphereBufferID, std::vector<Sphere>& spheres)
+// same layout as the std140 FrameParams block in frameparams.glsl
+struct FrameParams
+{
+    glm::vec3 camera;
+    float focal_length;
+    glm::vec3 sky_color;
+    uint32_t time;
+    glm::vec3 horizont_color;
+    int samples_per_pixel;
+    glm::vec2 camera_rotation;
+    glm::ivec2 resolution;
+    int bounces;
+    float target_error;
+    int trimesh_count;
+    int sphere_count;
+    int rendered_frames_count;
+    // TILE_ORDER_ of the compute ray pass
+    int tile_order;
+    glm::vec2 previous_camera_rotation;
+    glm::vec3 previous_camera;
+    float previous_focal_length;
+    int temporal_reprojection;
+    int motion_history;
+    int stop_at_target_error;
+    int padding;
+};
+static_assert(sizeof(FrameParams) == 128, "FrameParams has to match the std140 block");
+
+
+// same layout as _Sphere in raycommon.glsl
+struct SphereData
+{
+    glm::vec3 center;
+    float radius;
+    int material;
+};
+
+void updateSphere(UploadRing& uploads, GLuint sphereBufferID, std::vector<Sphere>& spheres, int i)
 {
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereBufferID);
+    SphereData sphere;
+    sphere.center = spheres[i].center;
+    sphere.radius = spheres[i].radius;
+    sphere.material = spheres[i].material_slot;
 
-    int sphere_size = sizeof(glm::vec3)
-        + sizeof(float)
-        + sizeof(glm::vec3)
-        + sizeof(glm::vec4)
-        + sizeof(float);
+    uploads.Write(sphereBufferID, i * sizeof(SphereData), sizeof(SphereData), &sphere);
+}
 
+void updateSphereMaterial(UploadRing& uploads, GLuint materialBufferID, std::vector<Sphere>& spheres, int i)
+{
+    uploads.Write(materialBufferID, spheres[i].material_slot * sizeof(Material), sizeof(Material), &spheres[i].material);
+}
+
+void updateSpheres(UploadRing& uploads, GLuint sphereBufferID, std::vector<Sphere>& spheres)
+{
+    growBuffer(sphereBufferID, sizeof(SphereData) * spheres.size());
     for (int i = 0; i < spheres.size(); i++)
+        updateSphere(uploads, sphereBufferID, spheres, i);
+}
+
+// uploads a newly added sphere i, all of them when the sphere buffer had to grow for it
+void addSphere(UploadRing& uploads, GLuint sphereBufferID, std::vector<Sphere>& spheres, int i)
+{
+    if (growBuffer(sphereBufferID, sizeof(SphereData) * spheres.size()))
+        updateSpheres(uploads, sphereBufferID, spheres);
+    else
+        updateSphere(uploads, sphereBufferID, spheres, i);
+}
+
+
+// top level bvh over every sphere and trimesh, leaves hold a single object index.
+// sphere i is stored as i and trimesh i as ~i, so removing one kind doesn't renumber the other
+int trimeshObject(int i)
+{
+    return ~i;
+}
+
+AxisAllignedBox sphereBox(const Sphere& sphere)
+{
+    float radius = std::abs(sphere.radius);
+    return { sphere.center - radius, sphere.center + radius };
+}
+
+// uploads the nodes that changed since the last upload, the buffer only grows
+void uploadTopLevel(UploadRing& uploads, GLuint tlasBufferID, GLuint tlasParentBufferID, DynamicBVH& tlas)
+{
+    if (tlas.nodes.empty())
     {
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sphere_size,
-            sizeof(glm::vec3), &spheres[i].center);
+        // a root that no ray can hit
+        BVHNode node = { glm::vec3(INFINITY), 0, glm::vec3(-INFINITY), 0 };
+        growBuffer(tlasBufferID, sizeof(BVHNode));
+        uploads.Write(tlasBufferID, 0, sizeof(BVHNode), &node);
+        tlas.dirty_first = INT_MAX;
+        tlas.dirty_last = -1;
+
+        int parent = -1;
+        growBuffer(tlasParentBufferID, sizeof(int));
+        uploads.Write(tlasParentBufferID, 0, sizeof(int), &parent);
+        return;
+    }
 
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sphere_size + sizeof(glm::vec3),
-            sizeof(float), &spheres[i].radius);
+    if (growBuffer(tlasBufferID, sizeof(BVHNode) * tlas.nodes.size()))
+        tlas.mark_all_dirty();
 
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sphere_size + sizeof(glm::vec3)
-            + sizeof(float), sizeof(glm::vec3), &spheres[i].material.color);
+    tlas.dirty_last = std::min(tlas.dirty_last, (int)tlas.nodes.size() - 1);
+    if (tlas.dirty_first <= tlas.dirty_last)
+    {
+        uploads.Write(tlasBufferID, tlas.dirty_first * sizeof(BVHNode),
+            (tlas.dirty_last - tlas.dirty_first + 1) * sizeof(BVHNode), &tlas.nodes[tlas.dirty_first]);
+    }
 
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sphere_size + sizeof(glm::vec3)
-            + sizeof(float) + sizeof(glm::vec3), sizeof(glm::vec4), &spheres[i].material.emission);
+    tlas.dirty_first = INT_MAX;
+    tlas.dirty_last = -1;
+
+    // parent links for the stackless traversal, a few bytes per node so they are always uploaded whole
+    growBuffer(tlasParentBufferID, sizeof(int) * tlas.parents.size());
+    uploads.Write(tlasParentBufferID, 0, sizeof(int) * tlas.parents.size(), tlas.parents.data());
+}
+
+// full rebuild, for changes that touch many objects at once
+void updateTopLevel(UploadRing& uploads, GLuint tlasBufferID, GLuint tlasParentBufferID, DynamicBVH& tlas, std::vector<Sphere>& spheres, std::vector<TriMesh>& trimeshes)
+{
+    std::vector<AxisAllignedBox> boxes;
+    std::vector<int> objects;
 
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sphere_size + sizeof(glm::vec3)
-            + sizeof(float) + sizeof(glm::vec3) + sizeof(glm::vec4), sizeof(float), &spheres[i].material.reflection);
+    for (int i = 0; i < spheres.size(); i++)
+    {
+        boxes.push_back(sphereBox(spheres[i]));
+        objects.push_back(i);
+    }
+
+    for (int i = 0; i < trimeshes.size(); i++)
+    {
+        // meshes without triangles can't be hit and have no valid box
+        if (trimeshes[i].mesh->slot == -1)
+            continue;
+
+        boxes.push_back(trimeshes[i].box);
+        objects.push_back(trimeshObject(i));
     }
+
+    tlas.rebuild(objects, boxes);
+    uploadTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas);
+}
+
+// inserts or refits a single sphere
+void updateTopLevelSphere(UploadRing& uploads, GLuint tlasBufferID, GLuint tlasParentBufferID, DynamicBVH& tlas, std::vector<Sphere>& spheres, int i)
+{
+    if (tlas.contains(i))
+        tlas.move(i, sphereBox(spheres[i]));
+    else
+        tlas.insert(i, sphereBox(spheres[i]));
+
+    uploadTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas);
+}
+
+void updateTopLevelTriMesh(UploadRing& uploads, GLuint tlasBufferID, GLuint tlasParentBufferID, DynamicBVH& tlas, std::vector<TriMesh>& trimeshes, int i)
+{
+    int object = trimeshObject(i);
+
+    if (trimeshes[i].mesh->slot == -1)
+        tlas.remove(object);
+    else if (tlas.contains(object))
+        tlas.move(object, trimeshes[i].box);
+    else
+        tlas.insert(object, trimeshes[i].box);
+
+    uploadTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas);
+}
+
+// call after spheres[i] was erased, the spheres after it move down by one
+void removeTopLevelSphere(UploadRing& uploads, GLuint tlasBufferID, GLuint tlasParentBufferID, DynamicBVH& tlas, std::vector<Sphere>& spheres, int i)
+{
+    tlas.remove(i);
+    for (int j = i; j < spheres.size(); j++)
+        tlas.rename(j + 1, j);
+
+    uploadTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas);
+}
+
+void removeTopLevelTriMesh(UploadRing& uploads, GLuint tlasBufferID, GLuint tlasParentBufferID, DynamicBVH& tlas, std::vector<TriMesh>& trimeshes, int i)
+{
+    tlas.remove(trimeshObject(i));
+    for (int j = i; j < trimeshes.size(); j++)
+        tlas.rename(trimeshObject(j + 1), trimeshObject(j));
+
+    uploadTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas);
 }
 
 
+// defines every ray shader program is built with. lanes are counted with subgroup ballots in the megakernels,
+// see count_occupancy in raycommon.glsl
+std::string rayShaderDefines(bool stackless_traversal, bool count_lanes)
+{
+    std::string defines = stackless_traversal ? "#define STACKLESS_TRAVERSAL\n" : "";
+    if (count_lanes)
+        defines += "#extension GL_KHR_shader_subgroup_ballot : require\n#define OCCUPANCY_STATS\n";
+    return defines;
+}
+
+// the generic megakernel of the fragment or the compute ray pass, the wavefront pass uses the compute one
+// as its generic program but traces with its own kernels
+Shader createRayShader(bool stackless_traversal, int ray_backend, bool count_lanes)
+{
+    std::string defines = rayShaderDefines(stackless_traversal, count_lanes);
+    if (ray_backend != RAY_BACKEND_FRAGMENT)
+        return Shader::Compute("shaders/rayCompute.comp", defines);
+    return Shader("shaders/rayVert.vert", "shaders/rayFrag.frag", defines);
+}
+
+// defines of a ray shader specialized for the current settings and scene, see the VARIANT_ macros in raycommon.glsl
+std::string rayShaderVariantDefines(bool stackless_traversal, bool count_lanes, int bounces, int samples_per_pixel, int sphere_count, int trimesh_count)
+{
+    std::string defines = rayShaderDefines(stackless_traversal, count_lanes);
+    defines += "#define VARIANT_BOUNCES " + std::to_string(bounces) + "\n";
+    defines += "#define VARIANT_SAMPLES_PER_PIXEL " + std::to_string(samples_per_pixel) + "\n";
+    if (sphere_count == 0)
+        defines += "#define VARIANT_NO_SPHERES\n";
+    if (trimesh_count == 0)
+        defines += "#define VARIANT_NO_TRIMESHES\n";
+    return defines;
+}
+
+// the traversal benchmark times each variant for this many frames after skipping the warmup
+#define BENCHMARK_WARMUP_FRAMES 16
+#define BENCHMARK_FRAMES 128
+
+
 void add_vec4_to_save(std::stringstream& ss, glm::vec4 v)
 {
     ss << v.x << " " << v.y << " " << v.z << " " << v.w;
@@ -279,6 +589,7 @@ int main(void)
     /* Make the window's context current */
     glfwMakeContextCurrent(window);
     gladLoadGL();
+    bool parallel_compile = Shader::EnableParallelCompile();
     glViewport(0, 0, width, height);
 
     glfwSetCursorPosCallback(window, cursor_position_callback);
@@ -313,9 +624,26 @@ int main(void)
 
 
 
-    Framebuffer fbo(width, height);
-    Framebuffer fbo2(width, height);
+    // linear color of the last fragment ray pass, or of any ray pass while reprojecting
+    Framebuffer fbo(width, height, GL_RGBA32F);
+    // primary hit distance and object of every pixel, see primary_surface in raycommon.glsl,
+    // and the primary normal and albedo for the denoiser
+    GLuint fboSurfaceTex = fbo.AddColorAttachment(GL_RG32F);
+    GLuint fboNormalTex = fbo.AddColorAttachment(GL_RGBA16F);
+    GLuint fboAlbedoTex = fbo.AddColorAttachment(GL_RGBA8);
+    // accumulated linear color, the frame count of each pixel in alpha. the second pass blends one into the other
+    // and swap roles every frame, the compute passes blend in place unless the second pass reprojects.
+    // the second attachment keeps the surfaces the accumulated color was reprojected to,
+    // the third the mean squared luminance adaptive sampling estimates the error from
+    Framebuffer accumulation[2] = { Framebuffer(width, height, GL_RGBA32F), Framebuffer(width, height, GL_RGBA32F) };
+    for (auto& target : accumulation)
+    {
+        target.AddColorAttachment(GL_RG32F);
+        target.AddColorAttachment(GL_R32F);
+    }
+    int accumulation_index = 0;
     Shader shader("shaders/default.vert", "shaders/default.frag");
+    Shader tonemap("shaders/default.vert", "shaders/tonemap.frag");
     Shader shader_inverse("shaders/default.vert", "shaders/modified.frag");
 
     VAO vao;
@@ -326,20 +654,46 @@ int main(void)
     vao.LinkAttrib(vbo);
 
     /////////////////////////////////////////////////////////////////////////////////////////
-    uint32_t previousFrameTex;
-    glGenTextures(1, &previousFrameTex);
-    glBindTexture(GL_TEXTURE_2D, previousFrameTex);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
 
-    Shader rayShader("shaders/rayVert.vert", "shaders/rayFrag.frag");
+    bool stackless_traversal = false;
+    // the compute megakernel traces and accumulates in one dispatch instead of the two fragment passes,
+    // the wavefront pass runs a kernel per bounce stage over queues of the paths still alive
+    int ray_backend = RAY_BACKEND_FRAGMENT;
+    int tile_order = TILE_ORDER_STRIPS;
+    WavefrontTracer wavefront;
+
+    // percentage of lanes carrying a path at each bounce, per ray backend and -1 until measured
+    bool occupancy_stats = false;
+    bool subgroup_ballot = glfwExtensionSupported("GL_KHR_shader_subgroup");
+    bool count_megakernel_lanes = false;
+    float occupancy[RAY_BACKEND_COUNT][OCCUPANCY_MAX_BOUNCES];
+    GLuint occupancyBufferID;
+    glGenBuffers(1, &occupancyBufferID);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, occupancyBufferID);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * OCCUPANCY_MAX_BOUNCES * sizeof(uint32_t), nullptr, GL_DYNAMIC_READ);
+
+    Shader rayShader = createRayShader(stackless_traversal, ray_backend, count_megakernel_lanes);
+    // the generic rayShader draws while a variant compiles. without parallel compiling a variant would
+    // compile in the frame that first asks for it, so the generic program is used instead
+    bool specialize_ray_shader = parallel_compile;
+    ShaderVariants rayVariants("shaders/rayVert.vert", "shaders/rayFrag.frag", RAY_SHADER_VARIANT_COUNT);
+    ShaderVariants rayComputeVariants("shaders/rayCompute.comp", RAY_SHADER_VARIANT_COUNT);
+    GpuTimer rayTimer;
+    // filters the accumulated image before it's shown
+    bool denoise = false;
+    int denoise_iterations = 4;
+    Denoiser denoiser(width, height);
+    GpuTimer denoiseTimer;
+    // pixels the ray pass found converged, counted on the gpu and read back a few frames late
+    GpuCounter convergedPixels;
+
+    // -1 when no benchmark is running
+    int benchmark_frame = -1;
+    double benchmark_ms[2] = { 0.0, 0.0 };
     Shader raySecondPass("shaders/rayVert2.vert", "shaders/rayFrag2.frag");
+    // fixed by layout(binding) in both passes, so it stays valid when the ray shader is rebuilt
+    BlockHandle frameParamsBlock = rayShader.UniformBlock("FrameParams");
 
     double prevTime = 0.0;
     /* Loop until the user closes the window */
@@ -354,6 +708,11 @@ int main(void)
 
     float focal_length = 1.0;
 
+    // camera the accumulated image was rendered from, for the reprojecting second pass
+    glm::vec3 previous_camera = camera;
+    glm::vec2 previous_camera_rot = camera_rot;
+    float previous_focal_length = focal_length;
+
 
 
     std::vector<TriMesh> trimeshes;
@@ -384,55 +743,83 @@ int main(void)
     trimeshes.push_back(trimesh2);
      
     
-    GLuint trimeshBufferID;
-    glGenBuffers(1, &trimeshBufferID);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, trimeshBufferID);
-    
-    int trimesh_size = sizeof(glm::vec3) * MAX_VERTEX_COUNT
-        + sizeof(glm::ivec3) * MAX_INDICES_COUNT
-        + sizeof(glm::vec3)
-        + sizeof(glm::vec4)
-        + sizeof(float)
-        + sizeof(AxisAllignedBox);
-
-    int padding = trimesh_size % 16;
-    if (padding)
-    {
-        padding = 16 - padding;
-    }
-    padding = 0;
-    trimesh_size += padding;
-        
-    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_TRIMESH_COUNT * trimesh_size,
-                                          nullptr, GL_STATIC_DRAW);
+    UploadRing uploads(UPLOAD_RING_FRAME_SIZE);
 
+    // mesh table, triangle and node pools and instances are sized by the scene and grow when it does
+    GLuint meshBufferID;
+    glGenBuffers(1, &meshBufferID);
 
+    GLuint trianglePoolBufferID;
+    glGenBuffers(1, &trianglePoolBufferID);
 
+    GLuint nodePoolBufferID;
+    glGenBuffers(1, &nodePoolBufferID);
 
-    glm::mat4 transform = glm::identity<glm::mat4>();
+    GLuint quantizedPoolBufferID;
+    glGenBuffers(1, &quantizedPoolBufferID);
+
+    GLuint instanceBufferID;
+    glGenBuffers(1, &instanceBufferID);
+
+    GLuint materialBufferID;
+    glGenBuffers(1, &materialBufferID);
 
  
-    updateTriMeshes(trimeshBufferID, trimeshes);
+    updateMeshes(meshBufferID, trianglePoolBufferID, nodePoolBufferID, quantizedPoolBufferID, trimeshes);
+    updateMaterials(uploads, materialBufferID, spheres, trimeshes);
+    updateTriMeshes(uploads, instanceBufferID, trimeshes);
   
    
 
     GLuint sphereBufferID;
     glGenBuffers(1, &sphereBufferID);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereBufferID);
-
-    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_SPHERE_COUNT * (sizeof(glm::vec3)
-                        + sizeof(float)
-                        + sizeof(glm::vec3)
-                        + sizeof(glm::vec4)
-                        + sizeof(float)), nullptr, GL_STATIC_DRAW);
-
-    updateSpheres(sphereBufferID, spheres);
+    updateSpheres(uploads, sphereBufferID, spheres);
+
+    GLuint tlasBufferID;
+    glGenBuffers(1, &tlasBufferID);
+
+    GLuint tlasParentBufferID;
+    glGenBuffers(1, &tlasParentBufferID);
+
+    DynamicBVH tlas;
+    updateTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas, spheres, trimeshes);
+
+    // rewritten through the upload ring every frame and bound to the FrameParams block of both ray passes
+    GLuint frameParamsBufferID;
+    glGenBuffers(1, &frameParamsBufferID);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameParamsBufferID);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameParams), nullptr, GL_DYNAMIC_DRAW);
+
+    // by their block names in raycommon.glsl, every ray program binds the ones it uses where it declares them
+    std::vector<StorageBuffer> rayBuffers = {
+        { "meshBuffer", meshBufferID },
+        { "sphereBuffer", sphereBufferID },
+        { "tlasBuffer", tlasBufferID },
+        { "instanceBuffer", instanceBufferID },
+        { "tlasParentBuffer", tlasParentBufferID },
+        { "trianglePoolBuffer", trianglePoolBufferID },
+        { "nodePoolBuffer", nodePoolBufferID },
+        { "materialBuffer", materialBufferID },
+        { "quantizedGeometryBuffer", quantizedPoolBufferID },
+        { "occupancyBuffer", occupancyBufferID },
+        { "convergenceBuffer", convergedPixels.counterBuffer }
+    };
 
 
     
     int sample_per_pixel = 1;
     int bounce_count = 4;
-    int fraction_pixel_per_frame = 2;
+    // adaptive sampling: pixels whose relative error is below target_error get no new samples, 0 traces every pixel.
+    // the stop mode never revisits them and ends the render once every pixel has converged
+    float target_error = 0.f;
+    bool stop_at_target_error = false;
+    bool render_finished = false;
+    uint32_t render_start_frame = 0;
+    // frames from the last restart until every pixel converged
+    uint32_t render_frames = 0;
+    // camera moves reproject the accumulated image instead of restarting it
+    bool reproject_on_motion = false;
+    int motion_history = 16;
 
     unsigned int time = 0;
 
@@ -508,8 +895,11 @@ int main(void)
         if (ImGui::Button("load"))
         {
             load_scene(paths_to_models[path_index], camera, camera_rot, sky_color, horizont, spheres, trimeshes);
-            updateSpheres(sphereBufferID, spheres);
-            updateTriMeshes(trimeshBufferID, trimeshes);
+            updateMeshes(meshBufferID, trianglePoolBufferID, nodePoolBufferID, quantizedPoolBufferID, trimeshes);
+            updateMaterials(uploads, materialBufferID, spheres, trimeshes);
+            updateSpheres(uploads, sphereBufferID, spheres);
+            updateTriMeshes(uploads, instanceBufferID, trimeshes);
+            updateTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas, spheres, trimeshes);
             frameCounter = 1;
         }
 
@@ -542,10 +932,114 @@ int main(void)
         {
             frameCounter = 1;
         }
-        if (ImGui::SliderInt("Fraction pixel per frame", &fraction_pixel_per_frame, 1, 100))
+        if (ImGui::SliderFloat("target error", &target_error, 0.f, 0.1f, "%.3f"))
+        {
+            frameCounter = 1;
+        }
+        if (target_error > 0.f)
+        {
+            ImGui::SameLine();
+            if (ImGui::Checkbox("stop at target error", &stop_at_target_error))
+            {
+                frameCounter = 1;
+            }
+            long long converged = convergedPixels.GetValue();
+            if (render_finished)
+                ImGui::Text("converged 100%% after %u frames", render_frames);
+            else if (converged >= 0)
+                ImGui::Text("converged %.1f%%", 100.0 * converged / ((double)fbo.width * fbo.height));
+        }
+        if (ImGui::Checkbox("reproject on camera motion", &reproject_on_motion))
         {
             frameCounter = 1;
         }
+        if (reproject_on_motion)
+        {
+            ImGui::SameLine();
+            ImGui::SliderInt("motion history", &motion_history, 1, 64);
+        }
+
+        ImGui::Text("ray pass %.2f ms", rayTimer.GetMilliseconds());
+
+        ImGui::Checkbox("denoise", &denoise);
+        if (denoise)
+        {
+            ImGui::SameLine();
+            ImGui::SliderInt("iterations", &denoise_iterations, 1, DENOISE_MAX_ITERATIONS);
+            ImGui::Text("denoise %.2f ms", denoiseTimer.GetMilliseconds());
+        }
+
+        if (ImGui::Checkbox("stackless traversal", &stackless_traversal) && benchmark_frame == -1)
+        {
+            rayShader.Delete();
+            rayShader = createRayShader(stackless_traversal, ray_backend, count_megakernel_lanes);
+        }
+        ImGui::SameLine();
+        ImGui::BeginDisabled(!parallel_compile);
+        ImGui::Checkbox("specialized shader", &specialize_ray_shader);
+        ImGui::EndDisabled();
+        if (rayVariants.IsCompiling() || rayComputeVariants.IsCompiling())
+        {
+            ImGui::SameLine();
+            ImGui::Text("(compiling)");
+        }
+        if (ImGui::Button("benchmark traversal") && benchmark_frame == -1)
+        {
+            benchmark_frame = 0;
+        }
+        // every ray pass accumulates into the same texture, so switching keeps the image
+        ImGui::BeginDisabled(benchmark_frame != -1);
+        if (ImGui::Combo("ray pass", &ray_backend, "fragment\0compute\0wavefront\0"))
+        {
+            rayShader.Delete();
+            rayShader = createRayShader(stackless_traversal, ray_backend, count_megakernel_lanes);
+        }
+        if (ImGui::Checkbox("occupancy stats", &occupancy_stats))
+        {
+            for (auto& backend : occupancy)
+                for (float& percentage : backend)
+                    percentage = -1.f;
+            count_megakernel_lanes = occupancy_stats && subgroup_ballot;
+            rayShader.Delete();
+            rayShader = createRayShader(stackless_traversal, ray_backend, count_megakernel_lanes);
+        }
+        ImGui::EndDisabled();
+        if (ray_backend == RAY_BACKEND_COMPUTE)
+        {
+            ImGui::SameLine();
+            ImGui::Combo("tile order", &tile_order, "rows\0strips\0");
+        }
+        if (occupancy_stats && !subgroup_ballot)
+        {
+            ImGui::Text("megakernel lanes need GL_KHR_shader_subgroup");
+        }
+        if (occupancy_stats && ImGui::BeginTable("occupancy", RAY_BACKEND_COUNT + 1))
+        {
+            ImGui::TableSetupColumn("bounce");
+            ImGui::TableSetupColumn("fragment");
+            ImGui::TableSetupColumn("compute");
+            ImGui::TableSetupColumn("wavefront");
+            ImGui::TableHeadersRow();
+            for (int i = 0; i <= bounce_count && i < OCCUPANCY_MAX_BOUNCES; i++)
+            {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::Text("%d", i);
+                for (int backend = 0; backend < RAY_BACKEND_COUNT; backend++)
+                {
+                    ImGui::TableNextColumn();
+                    if (occupancy[backend][i] >= 0.f)
+                        ImGui::Text("%.1f%%", occupancy[backend][i]);
+                    else
+                        ImGui::TextUnformatted("-");
+                }
+            }
+            ImGui::EndTable();
+        }
+        if (benchmark_frame == -1 && benchmark_ms[0] > 0.0)
+        {
+            ImGui::Text("stack %.3f ms, stackless %.3f ms", benchmark_ms[0], benchmark_ms[1]);
+        }
 
 
         ImGui::InputInt("width", &width);
@@ -572,9 +1066,12 @@ int main(void)
        
         if (ImGui::Button("add##0"))
         {
+            // an empty trimesh has no box, it joins the top level when a model is loaded
             TriMesh trimesh;
             trimeshes.push_back(trimesh);
-            updateTriMeshes(trimeshBufferID, trimeshes);
+            updateMaterials(uploads, materialBufferID, spheres, trimeshes);
+            updateSpheres(uploads, sphereBufferID, spheres);
+            addTriMesh(uploads, instanceBufferID, trimeshes, trimeshes.size() - 1);
             frameCounter = 1;
         }
         ImGui::SameLine();
@@ -588,14 +1085,18 @@ int main(void)
             {
 
                 auto& trimesh = *it;
+                int index = it - trimeshes.begin();
                 ImGui::PushID(id);
 
                 bool updated = false;
+                bool removed = false;
+                bool moved = false;
+                bool material_changed = false;
 
                 if (ImGui::Button("remove"))
                 {
                     it = trimeshes.erase(it);
-                    updated = true;
+                    removed = true;
                 }
                 else
                     it++;
@@ -609,25 +1110,38 @@ int main(void)
                     ImGui::Indent();
                     
                     if (ImGui::DragFloat3("translation", &trimesh.translation.x, 0.1f))
-                        updated = true;
+                        moved = true;
 
                     if (ImGui::DragFloat3("rotation", &trimesh.rotation.x, 0.1f))
-                        updated = true;
+                        moved = true;
 
                     if (ImGui::DragFloat3("scale", &trimesh.scale.x, 0.1f))
-                        updated = true;
+                        moved = true;
                     
                     if (ImGui::ColorEdit3("color", &trimesh.material.color.r))
-                        updated = true;
+                        material_changed = true;
 
                     if (ImGui::ColorEdit3("emission", &trimesh.material.emission.r))
-                        updated = true;
+                        material_changed = true;
 
                     if (ImGui::SliderFloat("emission strength", &trimesh.material.emission.a, 0.0f, 100.f))
-                        updated = true;
+                        material_changed = true;
 
                     if (ImGui::SliderFloat("reflectivity", &trimesh.material.reflection, 0.0f, 1.0f))
+                        material_changed = true;
+
+                    // rebuilds the shared mesh, every trimesh using it gets the new bvh
+                    if (ImGui::Checkbox("spatial splits", &trimesh.mesh->spatial_splits))
+                    {
+                        load_or_build_mesh_bvh(*trimesh.mesh);
                         updated = true;
+                    }
+
+                    if (ImGui::Checkbox("16 bit geometry", &trimesh.mesh->quantized))
+                    {
+                        load_or_build_mesh_bvh(*trimesh.mesh);
+                        updated = true;
+                    }
 
                     
                     
@@ -644,10 +1158,7 @@ int main(void)
 
                     if (ImGui::Button("load"))
                     {
-                        trimesh.vertices.clear();
-                        trimesh.indices.clear();
-
-                        parse_obj(paths_to_models[path_index], trimesh.vertices, trimesh.indices);
+                        trimesh.mesh = load_mesh(paths_to_models[path_index]);
                         trimesh.filename = paths_to_models[path_index];
                         updated = true;
                     }
@@ -678,11 +1189,38 @@ int main(void)
                     
                     ImGui::Unindent();
                 }
-                if (updated)
+                if (removed)
+                {
+                    updateMeshes(meshBufferID, trianglePoolBufferID, nodePoolBufferID, quantizedPoolBufferID, trimeshes);
+                    updateMaterials(uploads, materialBufferID, spheres, trimeshes);
+                    updateSpheres(uploads, sphereBufferID, spheres);
+                    updateTriMeshes(uploads, instanceBufferID, trimeshes);
+                    removeTopLevelTriMesh(uploads, tlasBufferID, tlasParentBufferID, tlas, trimeshes, index);
+                    frameCounter = 1;
+                }
+                else if (updated)
                 {
-                    updateTriMeshes(trimeshBufferID, trimeshes);
+                    updateMeshes(meshBufferID, trianglePoolBufferID, nodePoolBufferID, quantizedPoolBufferID, trimeshes);
+                    updateMaterials(uploads, materialBufferID, spheres, trimeshes);
+                    updateSpheres(uploads, sphereBufferID, spheres);
+                    updateTriMeshes(uploads, instanceBufferID, trimeshes);
+                    updateTopLevel(uploads, tlasBufferID, tlasParentBufferID, tlas, spheres, trimeshes);
                     frameCounter = 1;
                 }
+                else
+                {
+                    if (moved)
+                    {
+                        updateTriMeshTransform(uploads, instanceBufferID, trimeshes, index);
+                        updateTopLevelTriMesh(uploads, tlasBufferID, tlasParentBufferID, tlas, trimeshes, index);
+                        frameCounter = 1;
+                    }
+                    if (material_changed)
+                    {
+                        updateTriMeshMaterial(uploads, materialBufferID, trimeshes, index);
+                        frameCounter = 1;
+                    }
+                }
                 id++;
                 ImGui::PopID();
             }
@@ -694,7 +1232,9 @@ int main(void)
         {
             Sphere sphere;
             spheres.push_back(sphere);
-            updateSpheres(sphereBufferID, spheres);
+            updateMaterials(uploads, materialBufferID, spheres, trimeshes);
+            addSphere(uploads, sphereBufferID, spheres, spheres.size() - 1);
+            updateTopLevelSphere(uploads, tlasBufferID, tlasParentBufferID, tlas, spheres, spheres.size() - 1);
             frameCounter = 1;
         }
         ImGui::SameLine();
@@ -706,17 +1246,20 @@ int main(void)
             {
 
                 auto& sphere = *it;
+                int index = it - spheres.begin();
                 
 
                 ImGui::PushID(id);
 
                
-                bool updated = false;
+                bool removed = false;
+                bool moved = false;
+                bool material_changed = false;
                 
                 if (ImGui::Button("remove"))
                 {
                     it = spheres.erase(it);
-                    updated = true;
+                    removed = true;
                 }
                 else
                     it++;
@@ -730,22 +1273,22 @@ int main(void)
                     
                  
                     if (ImGui::DragFloat3("center", &sphere.center.x, 0.1f))
-                        updated = true;
+                        moved = true;
 
                     if (ImGui::DragFloat("radius", &sphere.radius, 0.01f))
-                        updated = true;
+                        moved = true;
                     
                     if (ImGui::ColorEdit3("color", &sphere.material.color.r))
-                        updated = true;
+                        material_changed = true;
 
                     if (ImGui::ColorEdit3("emission", &sphere.material.emission.r))
-                        updated = true;
+                        material_changed = true;
 
                     if (ImGui::SliderFloat("emission strength", &sphere.material.emission.a, 0.0f, 100.f))
-                        updated = true;
+                        material_changed = true;
 
                     if (ImGui::SliderFloat("reflectivity", &sphere.material.reflection, 0.0f, 1.0f))
-                        updated = true;
+                        material_changed = true;
 
                  
                     ImGui::Unindent();
@@ -753,9 +1296,22 @@ int main(void)
                
                 
 
-                if (updated)
+                if (removed)
+                {
+                    updateMaterials(uploads, materialBufferID, spheres, trimeshes);
+                    updateSpheres(uploads, sphereBufferID, spheres);
+                    removeTopLevelSphere(uploads, tlasBufferID, tlasParentBufferID, tlas, spheres, index);
+                    frameCounter = 1;
+                }
+                else if (moved)
                 {
-                    updateSpheres(sphereBufferID, spheres);
+                    updateSphere(uploads, sphereBufferID, spheres, index);
+                    updateTopLevelSphere(uploads, tlasBufferID, tlasParentBufferID, tlas, spheres, index);
+                    frameCounter = 1;
+                }
+                else if (material_changed)
+                {
+                    updateSphereMaterial(uploads, materialBufferID, spheres, index);
                     frameCounter = 1;
                 }
                 id++;
@@ -766,11 +1322,13 @@ int main(void)
         ImGui::Unindent(40);
 
 
+        // the reprojecting second pass keeps the accumulated image through camera moves
+        bool camera_moved = false;
         if (delta_mouse_pos.x || delta_mouse_pos.y)
         {
             camera_rot += delta_mouse_pos * (float)deltaTime * sensitivity;
             delta_mouse_pos = { 0, 0 };
-            frameCounter = 1;
+            camera_moved = true;
         }
 
         if (is_key_pressed(window, GLFW_KEY_W))
@@ -779,7 +1337,7 @@ int main(void)
             roty = rotate_y(roty, camera_rot.y);
             glm::vec3 dir = { 0, 0, 1 };
             camera -= dir * rotx * roty * (float)deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
         if (is_key_pressed(window, GLFW_KEY_S))
         {
@@ -787,7 +1345,7 @@ int main(void)
             roty = rotate_y(roty, camera_rot.y);
             glm::vec3 dir = { 0, 0, -1 };
             camera -= dir * rotx * roty * (float)deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
         if (is_key_pressed(window, GLFW_KEY_A))
         {
@@ -795,7 +1353,7 @@ int main(void)
             roty = rotate_y(roty, camera_rot.y);
             glm::vec3 dir = { 1, 0, 0 };
             camera -= dir * rotx * roty * (float)deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
         if (is_key_pressed(window, GLFW_KEY_D))
         {
@@ -803,28 +1361,28 @@ int main(void)
             roty = rotate_y(roty, camera_rot.y);
             glm::vec3 dir = { -1, 0, 0 };
             camera -= dir * rotx * roty * (float)deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
 
         if (is_key_pressed(window, GLFW_KEY_UP))
         {
             camera_rot.x += deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
         if (is_key_pressed(window, GLFW_KEY_DOWN))
         {
             camera_rot.x -= deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
         if (is_key_pressed(window, GLFW_KEY_LEFT))
         {
             camera_rot.y += deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
         if (is_key_pressed(window, GLFW_KEY_RIGHT))
         {
             camera_rot.y -= deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
 
         if (is_key_pressed(window, GLFW_KEY_SPACE))
@@ -833,7 +1391,7 @@ int main(void)
       
             glm::vec3 dir = { 0, -1, 0 };
             camera -= dir * (float)deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
             
         }
 
@@ -843,87 +1401,235 @@ int main(void)
       
             glm::vec3 dir = { 0, 1, 0 };
             camera -= dir * (float)deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
 
         }
 
         if (is_key_pressed(window, GLFW_KEY_COMMA))
         {
             focal_length -= deltaTime;
-            frameCounter = 1;
+            camera_moved = true;
         }
 
         if (is_key_pressed(window, GLFW_KEY_PERIOD))
         {
             focal_length += deltaTime;
+            camera_moved = true;
+        }
+
+        if (camera_moved && !reproject_on_motion)
+        {
             frameCounter = 1;
         }
 
+        // the stop mode ends the render once the counter says every pixel converged. counts from before a restart
+        // are still in flight for a few frames, so the counter is only trusted once those can't be read anymore
+        if (frameCounter == 1 || camera_moved || !stop_at_target_error || target_error <= 0.f || benchmark_frame != -1)
+        {
+            render_finished = false;
+            render_start_frame = frameCounter;
+        }
+        else if (!render_finished && frameCounter > render_start_frame + ADAPTIVE_MIN_FRAMES + GPU_COUNTER_READBACK_COUNT
+            && convergedPixels.GetValue() >= (long long)fbo.width * fbo.height)
+        {
+            render_finished = true;
+            render_frames = frameCounter - render_start_frame;
+            std::cout << "converged to target error " << target_error << " after " << render_frames << " frames\n";
+        }
+
         if (is_key_pressed(window, GLFW_KEY_P))
         {
             break;
         }
 
 
+        // runs the stack and the stackless variant on the current scene one after another and keeps the faster one
+        if (benchmark_frame >= 0)
+        {
+            int variant = benchmark_frame / (BENCHMARK_WARMUP_FRAMES + BENCHMARK_FRAMES);
+            int frame = benchmark_frame % (BENCHMARK_WARMUP_FRAMES + BENCHMARK_FRAMES);
+
+            if (frame == 0)
+            {
+                stackless_traversal = variant == 1;
+                rayShader.Delete();
+                rayShader = createRayShader(stackless_traversal, ray_backend, count_megakernel_lanes);
+                benchmark_ms[variant] = 0.0;
+            }
+            else if (frame >= BENCHMARK_WARMUP_FRAMES)
+            {
+                benchmark_ms[variant] += rayTimer.GetMilliseconds() / BENCHMARK_FRAMES;
+            }
+
+            benchmark_frame++;
+            if (benchmark_frame == 2 * (BENCHMARK_WARMUP_FRAMES + BENCHMARK_FRAMES))
+            {
+                std::cout << "traversal benchmark: stack " << benchmark_ms[0] << " ms, stackless " << benchmark_ms[1] << " ms per ray pass\n";
+
+                stackless_traversal = benchmark_ms[1] < benchmark_ms[0];
+                rayShader.Delete();
+                rayShader = createRayShader(stackless_traversal, ray_backend, count_megakernel_lanes);
+                benchmark_frame = -1;
+            }
+        }
+
         // first pass
-        
-        fbo.Bind();
-       
-        rayShader.Bind();
-        //rayShader.SetUInt("time", frameCounter);
-        rayShader.SetUInt("time", time);
-
-        int windowWidth, windowHeight;
-        glfwGetWindowSize(window, &windowWidth, &windowHeight);
-        rayShader.SetInt2("resolution", glm::ivec2(windowWidth, windowHeight));
-        rayShader.SetFloat3("camera", camera);
-        rayShader.SetFloat2("camera_rotation", camera_rot);
-        rayShader.SetFloat("focal_length", focal_length);
-        rayShader.SetInt("samples_per_pixel", sample_per_pixel);
-        rayShader.SetInt("bounces", bounce_count);
-        rayShader.SetInt("fraction_pixel_per_frame", fraction_pixel_per_frame);
-        rayShader.SetInt("trimesh_count", trimeshes.size());
-        rayShader.SetInt("sphere_count", spheres.size());
-
-        rayShader.SetFloat3("sky_color", sky_color);
-        rayShader.SetFloat3("horizont_color", horizont);
-
-
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, trimeshBufferID);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sphereBufferID);
+
+        // the benchmark compares the generic programs, so it doesn't wait on variants compiling
+        ShaderVariants& activeVariants = ray_backend == RAY_BACKEND_FRAGMENT ? rayVariants : rayComputeVariants;
+        Shader& activeRayShader = specialize_ray_shader && benchmark_frame == -1 && ray_backend != RAY_BACKEND_WAVEFRONT
+            ? activeVariants.Get(rayShaderVariantDefines(stackless_traversal, count_megakernel_lanes, bounce_count, sample_per_pixel, spheres.size(), trimeshes.size()), rayShader)
+            : rayShader;
+        activeRayShader.Bind();
+
+        // the render targets keep the size they were created with, every ray pass covers exactly them
+        glm::ivec2 resolution(fbo.width, fbo.height);
+
+        FrameParams params = {};
+        params.camera = camera;
+        params.focal_length = focal_length;
+        params.sky_color = sky_color;
+        params.time = time;
+        params.horizont_color = horizont;
+        params.samples_per_pixel = sample_per_pixel;
+        params.camera_rotation = camera_rot;
+        params.resolution = resolution;
+        params.bounces = bounce_count;
+        // the benchmark times every pixel
+        params.target_error = benchmark_frame == -1 ? target_error : 0.f;
+        params.trimesh_count = trimeshes.size();
+        params.sphere_count = spheres.size();
+        params.rendered_frames_count = frameCounter;
+        params.tile_order = tile_order;
+        params.previous_camera_rotation = previous_camera_rot;
+        params.previous_camera = previous_camera;
+        params.previous_focal_length = previous_focal_length;
+        params.temporal_reprojection = reproject_on_motion;
+        params.motion_history = motion_history;
+        params.stop_at_target_error = stop_at_target_error;
+        uploads.Write(frameParamsBufferID, 0, sizeof(FrameParams), &params);
+
+        previous_camera = camera;
+        previous_camera_rot = camera_rot;
+        previous_focal_length = focal_length;
+
+        // everything written since the last frame is copied before the ray pass reads it
+        uploads.Flush();
+
+        glBindBufferBase(GL_UNIFORM_BUFFER, frameParamsBlock.binding, frameParamsBufferID);
+
+        // the wavefront kernels bind theirs in Trace
+        activeRayShader.BindStorageBuffers(rayBuffers);
+
+        if (occupancy_stats)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, occupancyBufferID);
+            glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        }
         
 
        // glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, indicesBufferID);
-         // TODODO
-        for (size_t i = 0; i < trimeshes.size(); i++)
+        
+        // the compute passes blend straight into the accumulated image, unless the second pass reprojects it
+        GLuint computeTarget = reproject_on_motion ? fbo.fbTex : accumulation[accumulation_index].fbTex;
+        GLuint accumulatedMoments = accumulation[accumulation_index].colorTextures[2];
+
+        // the ray passes read the accumulated image to skip converged pixels. the ones that write it
+        // load it through their images, the others sample it here
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D, accumulation[accumulation_index].fbTex);
+        glActiveTexture(GL_TEXTURE5);
+        glBindTexture(GL_TEXTURE_2D, accumulatedMoments);
+        glActiveTexture(GL_TEXTURE0);
+        convergedPixels.Begin();
+
+        // primary surface, normal and albedo of the compute ray passes
+        glBindImageTexture(1, fboSurfaceTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+        glBindImageTexture(3, fboNormalTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(4, fboAlbedoTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+
+        if (render_finished)
         {
-            rayShader.SetInt("triangle_count[" + std::to_string(i) + "]", trimeshes[i].indices.size());
+            // nothing left to trace, the accumulated image is shown as it is
         }
-        
- 
-       
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        else if (ray_backend == RAY_BACKEND_WAVEFRONT)
+        {
+            rayTimer.Begin();
+            // the occupancy buffer is only cleared while the stats are shown, so the lanes are only counted then
+            std::string wavefrontDefines = rayShaderDefines(stackless_traversal, false);
+            if (occupancy_stats)
+                wavefrontDefines += "#define WAVEFRONT_OCCUPANCY_STATS\n";
+            wavefront.Trace(wavefrontDefines, rayBuffers, computeTarget, accumulatedMoments, resolution.x, resolution.y, sample_per_pixel, bounce_count);
+            rayTimer.End();
+        }
+        else if (ray_backend == RAY_BACKEND_COMPUTE)
+        {
+            glBindImageTexture(0, computeTarget, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+            glBindImageTexture(2, accumulatedMoments, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
 
+            rayTimer.Begin();
+            glDispatchCompute((resolution.x + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE, (resolution.y + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE, 1);
+            rayTimer.End();
+
+            // the next passes sample the images and the next frame loads them again
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        }
+        else
+        {
+            fbo.Bind();
+            rayTimer.Begin();
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            rayTimer.End();
+        }
+
+        // second pass, blends the previous accumulation into the other target
+        if (!render_finished && (ray_backend == RAY_BACKEND_FRAGMENT || reproject_on_motion))
+        {
+            int previous = accumulation_index;
+            accumulation_index = 1 - accumulation_index;
+            accumulation[accumulation_index].Bind();
+            raySecondPass.Bind();
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, accumulation[previous].fbTex);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, fbo.fbTex);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, accumulation[previous].colorTextures[1]);
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, fboSurfaceTex);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            glActiveTexture(GL_TEXTURE0);
+        }
+        convergedPixels.End();
+
+        // reading the counters back waits for the ray pass, so this only runs while the stats are shown
+        if (occupancy_stats)
+        {
+            uint32_t lanes[2][OCCUPANCY_MAX_BOUNCES];
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, occupancyBufferID);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(lanes), lanes);
+            for (int i = 0; i < OCCUPANCY_MAX_BOUNCES; i++)
+            {
+                if (lanes[1][i] > 0)
+                    occupancy[ray_backend][i] = 100.f * lanes[0][i] / lanes[1][i];
+            }
+        }
+        // denoiser passes between the accumulated image and the display
+        GLuint displayTex = accumulation[accumulation_index].fbTex;
+        if (denoise)
+        {
+            denoiseTimer.Begin();
+            displayTex = denoiser.Run(accumulation[accumulation_index].fbTex, accumulation[accumulation_index].colorTextures[2],
+                fboSurfaceTex, fboNormalTex, fboAlbedoTex, denoise_iterations);
+            denoiseTimer.End();
+        }
 
-        // second pass
-        glCopyImageSubData(fbo2.fbTex, GL_TEXTURE_2D, 0, 0, 0, 0, previousFrameTex, GL_TEXTURE_2D, 0, 0, 0, 0, width, height, 1);
-        fbo2.Bind();
-        raySecondPass.Bind();
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, previousFrameTex);
-        glActiveTexture(GL_TEXTURE1); 
-        glBindTexture(GL_TEXTURE_2D, fbo.fbTex);
-        raySecondPass.SetInt("old_texture", 0);
-        raySecondPass.SetInt("new_texture", 1);
-        raySecondPass.SetInt("rendered_frames_count", frameCounter);
-        raySecondPass.SetInt("fraction_pixel_per_frame", fraction_pixel_per_frame);
-        raySecondPass.SetUInt("time", time);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
         // third pass
-        fbo2.Unbind();
-        shader.Bind();
+        accumulation[accumulation_index].Unbind();
+        tonemap.Bind();
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, fbo2.fbTex);
+        glBindTexture(GL_TEXTURE_2D, displayTex);
 
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
@@ -932,7 +1638,13 @@ int main(void)
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
         glfwSwapBuffers(window);
-        
+
+        // glfw time starts at glfwInit, so this covers window creation, mesh loading and shader compilation
+        if (time == 1)
+        {
+            glFinish();
+            std::cout << "time to first frame: " << glfwGetTime() * 1000.0 << " ms\n";
+        }
     }
 
     ImGui_ImplOpenGL3_Shutdown();
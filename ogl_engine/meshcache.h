@@ -0,0 +1,256 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+
+#include "Object.h"
+#include "bvh.h"
+
+// built meshes are stored as <key>.mesh in this directory, the key hashes the obj file and everything that changes the built bvh
+#define MESH_CACHE_DIRECTORY "cache"
+#define MESH_CACHE_MAGIC 0x4853454d		// "MESH"
+#define FILE_STAMP_MAGIC 0x504d5453		// "STMP"
+// bump when the file layout, BVHNode, WideBVHNode or a builder changes
+#define MESH_CACHE_VERSION 3
+
+struct MeshCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint64_t vertex_count;
+	uint64_t source_index_count;
+	uint64_t index_count;
+	uint64_t node_count;
+	uint64_t wide_node_count;
+	// the material library and material names, each followed by a newline
+	uint64_t material_name_bytes;
+	AxisAllignedBox box;
+};
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// content hash of a source file as of its size and modification time, stored as <path hash>.stamp next to the meshes
+struct FileStamp
+{
+	uint32_t magic;
+	uint64_t size;
+	int64_t modified;
+	uint64_t hash;
+};
+
+inline std::filesystem::path file_stamp_path(const std::string& filename)
+{
+	std::error_code error;
+	std::string absolute = std::filesystem::absolute(filename, error).string();
+	std::stringstream name;
+	name << std::hex << std::setw(16) << std::setfill('0') << fnv1a(absolute.data(), absolute.size()) << ".stamp";
+	return std::filesystem::path(MESH_CACHE_DIRECTORY) / name.str();
+}
+
+// hash of the file contents, 0 when the file can't be read. the contents are only read and hashed when the size
+// or modification time differ from the stamp of the last call, so loading a cached mesh doesn't read the obj twice
+inline uint64_t hash_file(const std::string& filename)
+{
+	std::error_code error;
+	uint64_t size = std::filesystem::file_size(filename, error);
+	if (error)
+		return 0;
+	int64_t modified = (int64_t)std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+	if (error)
+		return 0;
+
+	std::filesystem::path stamp_path = file_stamp_path(filename);
+	FileStamp stamp = {};
+	std::ifstream stamp_file(stamp_path, std::ios::binary);
+	if (stamp_file.read((char*)&stamp, sizeof(stamp)) && stamp.magic == FILE_STAMP_MAGIC && stamp.size == size && stamp.modified == modified)
+		return stamp.hash;
+	stamp_file.close();
+
+	std::ifstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		return 0;
+
+	std::vector<char> bytes((size_t)size);
+	if (!file.read(bytes.data(), bytes.size()))
+		return 0;
+
+	stamp = {};
+	stamp.magic = FILE_STAMP_MAGIC;
+	stamp.size = size;
+	stamp.modified = modified;
+	stamp.hash = fnv1a(bytes.data(), bytes.size());
+
+	std::filesystem::create_directories(MESH_CACHE_DIRECTORY, error);
+	std::ofstream out(stamp_path, std::ios::binary);
+	out.write((const char*)&stamp, sizeof(stamp));
+	return stamp.hash;
+}
+
+inline uint64_t mesh_cache_key(const Mesh& mesh)
+{
+	const float params[] = {
+		(float)MESH_CACHE_VERSION, (float)mesh.spatial_splits, (float)mesh.quantized, (float)BVH_MAX_LEAF_SIZE, (float)LBVH_TRIANGLE_THRESHOLD,
+		(float)SBVH_BIN_COUNT, SBVH_OVERLAP_THRESHOLD, SBVH_MAX_DUPLICATION, (float)SBVH_MAX_DEPTH
+	};
+	return fnv1a(params, sizeof(params), mesh.content_hash);
+}
+
+inline std::filesystem::path mesh_cache_path(uint64_t key)
+{
+	std::stringstream name;
+	name << std::hex << std::setw(16) << std::setfill('0') << key << ".mesh";
+	return std::filesystem::path(MESH_CACHE_DIRECTORY) / name.str();
+}
+
+template<class T>
+void write_array(std::ofstream& file, const std::vector<T>& v)
+{
+	file.write((const char*)v.data(), sizeof(T) * v.size());
+}
+
+template<class T>
+const char* read_array(const char* src, std::vector<T>& v, uint64_t count)
+{
+	v.resize(count);
+	memcpy(v.data(), src, sizeof(T) * count);
+	return src + sizeof(T) * count;
+}
+
+inline std::string material_name_block(const Mesh& mesh)
+{
+	std::string block = mesh.material_library + "\n";
+	for (auto& name : mesh.material_names)
+		block += name + "\n";
+	return block;
+}
+
+inline void save_mesh_cache(const Mesh& mesh)
+{
+	if (mesh.content_hash == 0)
+		return;
+
+	uint64_t key = mesh_cache_key(mesh);
+
+	std::error_code error;
+	std::filesystem::create_directories(MESH_CACHE_DIRECTORY, error);
+
+	std::ofstream file(mesh_cache_path(key), std::ios::binary);
+	if (!file.is_open())
+	{
+		std::cout << "error saving mesh cache for " << mesh.filename << "\n";
+		return;
+	}
+
+	std::string names = material_name_block(mesh);
+
+	MeshCacheHeader header = { MESH_CACHE_MAGIC, MESH_CACHE_VERSION, key,
+		mesh.vertices.size(), mesh.source_indices.size(), mesh.indices.size(), mesh.bvh.size(), mesh.wide_bvh.size(), names.size(), mesh.box };
+
+	file.write((const char*)&header, sizeof(header));
+	write_array(file, mesh.vertices);
+	write_array(file, mesh.source_indices);
+	write_array(file, mesh.indices);
+	write_array(file, mesh.bvh);
+	write_array(file, mesh.wide_bvh);
+	write_array(file, mesh.source_materials);
+	write_array(file, mesh.triangle_materials);
+	file.write(names.data(), names.size());
+}
+
+// fills the geometry and bvh of mesh from the cache with a single read, false when there's no valid entry
+inline bool load_mesh_cache(Mesh& mesh)
+{
+	if (mesh.content_hash == 0)
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t key = mesh_cache_key(mesh);
+
+	std::ifstream file(mesh_cache_path(key), std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		return false;
+
+	std::vector<char> bytes((size_t)file.tellg());
+	file.seekg(0);
+	if (bytes.size() < sizeof(MeshCacheHeader) || !file.read(bytes.data(), bytes.size()))
+		return false;
+
+	MeshCacheHeader header;
+	memcpy(&header, bytes.data(), sizeof(header));
+
+	uint64_t expected_size = sizeof(header)
+		+ sizeof(glm::vec3) * header.vertex_count
+		+ sizeof(glm::ivec3) * (header.source_index_count + header.index_count)
+		+ sizeof(BVHNode) * header.node_count
+		+ sizeof(WideBVHNode) * header.wide_node_count
+		+ sizeof(uint32_t) * (header.source_index_count + header.index_count)
+		+ header.material_name_bytes;
+
+	if (header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION || header.key != key || expected_size != bytes.size())
+	{
+		std::cout << "ignoring stale mesh cache for " << mesh.filename << "\n";
+		return false;
+	}
+
+	const char* src = bytes.data() + sizeof(header);
+	src = read_array(src, mesh.vertices, header.vertex_count);
+	src = read_array(src, mesh.source_indices, header.source_index_count);
+	src = read_array(src, mesh.indices, header.index_count);
+	src = read_array(src, mesh.bvh, header.node_count);
+	src = read_array(src, mesh.wide_bvh, header.wide_node_count);
+	src = read_array(src, mesh.source_materials, header.source_index_count);
+	src = read_array(src, mesh.triangle_materials, header.index_count);
+	mesh.box = header.box;
+
+	std::stringstream names(std::string(src, header.material_name_bytes));
+	std::getline(names, mesh.material_library);
+	mesh.material_names.clear();
+	for (std::string name; std::getline(names, name);)
+		mesh.material_names.push_back(name);
+
+	std::chrono::duration<double, std::milli> load_time = std::chrono::steady_clock::now() - start;
+	std::cout << "loaded cached bvh for " << mesh.filename << ": " << mesh.bvh.size() << " nodes, " << load_time.count() << " ms\n";
+	return true;
+}
+
+// rebuilds the bvh of already parsed mesh for its current builder and storage settings, from the cache when possible
+inline void load_or_build_mesh_bvh(Mesh& mesh)
+{
+	Mesh cached;
+	cached.filename = mesh.filename;
+	cached.content_hash = mesh.content_hash;
+	cached.spatial_splits = mesh.spatial_splits;
+	cached.quantized = mesh.quantized;
+
+	if (load_mesh_cache(cached))
+	{
+		mesh.indices = std::move(cached.indices);
+		mesh.triangle_materials = std::move(cached.triangle_materials);
+		mesh.bvh = std::move(cached.bvh);
+		mesh.wide_bvh = std::move(cached.wide_bvh);
+		mesh.box = cached.box;
+	}
+	else
+	{
+		build_mesh_bvh(mesh);
+		save_mesh_cache(mesh);
+	}
+	build_vertex_columns(mesh);
+}
@@ -6,8 +6,12 @@
 #include <fstream>
 
 #include <sstream>
+#include <map>
+#include <filesystem>
 
 #include "Object.h"
+#include "bvh.h"
+#include "meshcache.h"
 
 template<class T>
 T base_name(T const& path, T const& delims = "/\\")
@@ -21,7 +25,16 @@ T remove_extension(T const& filename)
 	return p > 0 && p != T::npos ? filename.substr(0, p) : filename;
 }
 
-inline bool parse_obj(const std::string& filename, std::vector<glm::vec3>& vertices, std::vector<glm::ivec3>& indices)
+// text after the keyword of a line, without trailing whitespace
+inline std::string line_argument(const std::string& line, size_t keyword_length)
+{
+	std::string argument = line.substr(std::min(keyword_length, line.size()));
+	argument.erase(argument.find_last_not_of(" \t\r") + 1);
+	return argument;
+}
+
+// fills vertices, source_indices, their material ids and the material names and library of mesh
+inline bool parse_obj(const std::string& filename, Mesh& mesh)
 {
 
 
@@ -37,6 +50,7 @@ inline bool parse_obj(const std::string& filename, std::vector<glm::vec3>& verti
 
 	glm::vec3 v;
 	glm::ivec3 i;
+	uint32_t material = 0;
 
 
 
@@ -52,7 +66,21 @@ inline bool parse_obj(const std::string& filename, std::vector<glm::vec3>& verti
 
 			s << line;
 			s >> junk >> v.x >> v.y >> v.z;
-			vertices.push_back(v);
+			mesh.vertices.push_back(v);
+		}
+
+		if (line.rfind("mtllib ", 0) == 0)
+		{
+			mesh.material_library = (std::filesystem::path(filename).parent_path() / line_argument(line, 7)).string();
+		}
+
+		if (line.rfind("usemtl ", 0) == 0)
+		{
+			std::string name = line_argument(line, 7);
+			auto it = std::find(mesh.material_names.begin(), mesh.material_names.end(), name);
+			material = uint32_t(it - mesh.material_names.begin()) + 1;
+			if (it == mesh.material_names.end())
+				mesh.material_names.push_back(name);
 		}
 
 		if (line[0] == 'f')
@@ -88,7 +116,8 @@ inline bool parse_obj(const std::string& filename, std::vector<glm::vec3>& verti
 				i.x = is[0];
 				i.y = is[j + 1];
 				i.z = is[j + 2];
-				indices.push_back(i);
+				mesh.source_indices.push_back(i);
+				mesh.source_materials.push_back(material);
 			}
 
 			
@@ -101,92 +130,100 @@ inline bool parse_obj(const std::string& filename, std::vector<glm::vec3>& verti
 	return true;
 }
 
-inline TriMesh parse_obj(const std::string& filename)
+// reads the materials named by usemtl from the .mtl file of mesh, names missing from it stay grey.
+// emission is stored as a color with its brightest channel at 1 and that channel as the strength
+inline void load_material_library(Mesh& mesh)
 {
+	Material missing;
+	missing.color = glm::vec3(0.8f);
+	mesh.materials.assign(mesh.material_names.size(), missing);
 
-	std::cout << "loading " << filename << "...\n";
-
-	std::ifstream file;
-	file.open(filename);
-
-	TriMesh trimesh;
-
-	std::vector<glm::vec3> vertices;
-	std::vector<glm::ivec3> indices;
+	if (mesh.material_names.empty())
+		return;
 
+	std::ifstream file(mesh.material_library);
 	if (!file.is_open())
 	{
-		std::cout << "failed to load " << filename << "\n";
-		return trimesh;
+		std::cout << "failed to load material library " << mesh.material_library << "\n";
+		return;
 	}
-	std::string line;
-
-	glm::vec3 v;
-	glm::ivec3 i;
-
-
 
+	Material* material = nullptr;
+	std::string line;
 	while (std::getline(file, line))
 	{
-		std::stringstream s;
-		char junk;
-
+		std::stringstream s(line);
+		std::string type;
+		s >> type;
 
-		if (line[0] == 'v')
+		if (type == "newmtl")
 		{
-			if (line[1] != ' ') continue;
-
-			s << line;
-			s >> junk >> v.x >> v.y >> v.z;
-			vertices.push_back(v);
+			auto it = std::find(mesh.material_names.begin(), mesh.material_names.end(), line_argument(line, 7));
+			material = it != mesh.material_names.end() ? &mesh.materials[it - mesh.material_names.begin()] : nullptr;
 		}
-
-		if (line[0] == 'f')
+		else if (!material)
 		{
-			std::string new_line = "";
-			bool skip = false;
-			for (auto c : line)
-			{
-				if (c == '/')
-					skip = true;
-
-				if (c == ' ')
-					skip = false;
-
-				if (skip)
-					continue;
-
-				new_line += c;
-			}
-
-			s << new_line;
+			continue;
+		}
+		else if (type == "Kd")
+		{
+			s >> material->color.r >> material->color.g >> material->color.b;
+		}
+		else if (type == "Ke")
+		{
+			glm::vec3 emission(0.0f);
+			s >> emission.r >> emission.g >> emission.b;
+			float strength = std::max(std::max(emission.r, emission.g), emission.b);
+			material->emission = strength > 0.0f ? glm::vec4(emission / strength, strength) : glm::vec4(0.0f);
+		}
+		else if (type == "Pm")
+		{
+			s >> material->reflection;
+		}
+	}
+}
 
-			s >> junk;
-			std::vector<int> is;
-			int indice = 0;
-			while (s >> indice)
-			{
-				is.push_back(indice - 1);
-			}
+// returns the already loaded mesh when some trimesh still uses the same file
+inline std::shared_ptr<Mesh> load_mesh(const std::string& filename)
+{
+	static std::map<std::string, std::weak_ptr<Mesh>> loaded_meshes;
 
-			for (size_t j = 0; j < is.size() - 2; j++)
-			{
-				i.x = is[0];
-				i.y = is[j + 1];
-				i.z = is[j + 2];
-				indices.push_back(i);
-			}
+	if (auto mesh = loaded_meshes[filename].lock())
+		return mesh;
 
+	auto mesh = std::make_shared<Mesh>();
+	mesh->filename = filename;
+	mesh->content_hash = hash_file(filename);
 
+	// a cache hit skips parsing as well
+	if (load_mesh_cache(*mesh))
+	{
+		build_vertex_columns(*mesh);
+		load_material_library(*mesh);
+		loaded_meshes[filename] = mesh;
+		return mesh;
+	}
 
-		}
+	if (!parse_obj(filename, *mesh))
+	{
+		std::cout << "failed to load " << filename << "\n";
+		return mesh;
 	}
 
-	trimesh.vertices = vertices;
-	trimesh.indices = indices;
+	build_mesh_bvh(*mesh);
+	build_vertex_columns(*mesh);
+	load_material_library(*mesh);
+	save_mesh_cache(*mesh);
+	loaded_meshes[filename] = mesh;
+	return mesh;
+}
+
+inline TriMesh parse_obj(const std::string& filename)
+{
+	TriMesh trimesh;
+	trimesh.mesh = load_mesh(filename);
 	trimesh.name = remove_extension(base_name(filename));
 	trimesh.filename = filename;
-	std::cout << "finished loading " << filename << "\n";
 	return trimesh;
 }
 
@@ -273,7 +310,7 @@ inline void load_scene(const std::string& filename, glm::vec3& cam_pos, glm::vec
 				trimesh.material.color.r >> trimesh.material.color.g >> trimesh.material.color.b >>
 				trimesh.material.emission.x >> trimesh.material.emission.y >> trimesh.material.emission.z >> trimesh.material.emission.w;
 
-			parse_obj(trimesh.filename, trimesh.vertices, trimesh.indices);
+			trimesh.mesh = load_mesh(trimesh.filename);
 
 			trimeshes.push_back(trimesh);
 
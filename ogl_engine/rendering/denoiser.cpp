@@ -0,0 +1,59 @@
+#include "denoiser.h"
+
+Denoiser::Denoiser(int width, int height)
+	: demodulate("shaders/default.vert", "shaders/denoiseDemodulate.frag"),
+	atrous("shaders/default.vert", "shaders/denoiseAtrous.frag"),
+	remodulate("shaders/default.vert", "shaders/denoiseRemodulate.frag"),
+	targets{ Framebuffer(width, height, GL_RGBA32F), Framebuffer(width, height, GL_RGBA32F) },
+	result(width, height, GL_RGBA32F)
+{
+	stepSize = atrous.Uniform("step_size");
+}
+
+GLuint Denoiser::Run(GLuint color, GLuint moments, GLuint surface, GLuint normal, GLuint albedo, int iterations)
+{
+	// same units in every pass, see the layout(binding) of the denoise shaders
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, moments);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, surface);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, albedo);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, normal);
+	glActiveTexture(GL_TEXTURE0);
+
+	targets[0].Bind();
+	demodulate.Bind();
+	glBindTexture(GL_TEXTURE_2D, color);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+
+	int current = 0;
+	atrous.Bind();
+	for (int i = 0; i < iterations; i++)
+	{
+		targets[1 - current].Bind();
+		atrous.SetInt(stepSize, 1 << i);
+		glBindTexture(GL_TEXTURE_2D, targets[current].fbTex);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+		current = 1 - current;
+	}
+
+	result.Bind();
+	remodulate.Bind();
+	glBindTexture(GL_TEXTURE_2D, targets[current].fbTex);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	result.Unbind();
+
+	return result.fbTex;
+}
+
+void Denoiser::Delete()
+{
+	demodulate.Delete();
+	atrous.Delete();
+	remodulate.Delete();
+	for (auto& target : targets)
+		target.Delete();
+	result.Delete();
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <glad/glad.h>
+
+#include "shader.h"
+#include "framebuffer.h"
+
+#define DENOISE_MAX_ITERATIONS 5
+
+// edge aware a-trous denoiser in the spirit of svgf. the albedo of the primary hits is divided out of the accumulated
+// image, iterations of a 5x5 wavelet with doubling steps blur it without crossing depth, normal, object or
+// luminance edges, then the albedo is multiplied back in. the luminance edges are scaled by the variance of the
+// accumulated mean from the accumulated moments, so the filter backs off as pixels converge.
+// the passes draw the screen quad, the vao and the FrameParams block are bound by the caller like for the second pass
+class Denoiser
+{
+public:
+	Denoiser(int width, int height);
+	// filters color, the accumulated rgba32f image, with moments, the r32f mean squared luminance, and the primary
+	// surface, normal and albedo of the ray passes. returns the texture holding the result
+	GLuint Run(GLuint color, GLuint moments, GLuint surface, GLuint normal, GLuint albedo, int iterations);
+	void Delete();
+public:
+	Shader demodulate;
+	Shader atrous;
+	Shader remodulate;
+	UniformHandle stepSize;
+
+	// the iterations read one and write the other, rgb illumination with its variance in alpha
+	Framebuffer targets[2];
+	Framebuffer result;
+};
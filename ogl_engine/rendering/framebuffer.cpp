@@ -1,22 +1,15 @@
 #include "framebuffer.h"
 #include <iostream>
 
-Framebuffer::Framebuffer(int screenWidth, int screenHeight)
+Framebuffer::Framebuffer(int screenWidth, int screenHeight, GLenum internalFormat)
+	: width(screenWidth), height(screenHeight)
 {
 	glGenFramebuffers(1, &fb_id);
 	glBindFramebuffer(GL_FRAMEBUFFER, fb_id); // GL_FRAMEBUFFER  read ja write
 
-	glGenTextures(1, &fbTex);
-	glBindTexture(GL_TEXTURE_2D, fbTex);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, screenWidth, screenHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
+	fbTex = CreateTexture(internalFormat);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fbTex, 0);
+	colorTextures.push_back(fbTex);
 
 	glGenRenderbuffers(1, &rb_id);
 	glBindRenderbuffer(GL_RENDERBUFFER, rb_id);
@@ -34,6 +27,47 @@ Framebuffer::~Framebuffer()
 {
 }
 
+unsigned int Framebuffer::CreateTexture(GLenum internalFormat)
+{
+	unsigned int texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	// sized formats so the texture can also be bound as an image for compute shaders
+	GLenum format = internalFormat == GL_R32F ? GL_RED : internalFormat == GL_RG32F ? GL_RG : GL_RGBA;
+	GLenum type = internalFormat == GL_RGBA8 ? GL_UNSIGNED_BYTE : GL_FLOAT;
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+	// float targets would otherwise start with whatever was in memory, which can be nan
+	glClearTexImage(texture, 0, format, type, NULL);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return texture;
+}
+
+unsigned int Framebuffer::AddColorAttachment(GLenum internalFormat)
+{
+	unsigned int texture = CreateTexture(internalFormat);
+	colorTextures.push_back(texture);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fb_id);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + (GLenum)colorTextures.size() - 1, GL_TEXTURE_2D, texture, 0);
+
+	std::vector<GLenum> drawBuffers;
+	for (size_t i = 0; i < colorTextures.size(); i++)
+		drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + (GLenum)i);
+	glDrawBuffers((GLsizei)drawBuffers.size(), drawBuffers.data());
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		std::cout << "framebuffer incomplete!" << std::endl;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return texture;
+}
+
 void Framebuffer::Bind()
 {
 	glBindFramebuffer(GL_FRAMEBUFFER, fb_id);
@@ -1,16 +1,26 @@
 #pragma once
 #include <glad/glad.h>
+#include <vector>
 
 class Framebuffer
 {
 public:
-	Framebuffer(int screenWidth, int screenHeight);
+	// internalFormat is GL_RGBA8 or a float format like GL_RGBA32F
+	Framebuffer(int screenWidth, int screenHeight, GLenum internalFormat = GL_RGBA8);
 	~Framebuffer();
+	// adds a texture the fragment shader writes with layout(location = n) for the n-th attachment, fbTex is attachment 0
+	unsigned int AddColorAttachment(GLenum internalFormat);
 	void Bind();
 	void Unbind();
 	void Delete();
+private:
+	unsigned int CreateTexture(GLenum internalFormat);
 public:
 	unsigned int fb_id;
 	unsigned int rb_id;
 	unsigned int fbTex;
+	// fbTex and the added attachments in attachment order
+	std::vector<unsigned int> colorTextures;
+	int width;
+	int height;
 };
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "gpucounter.h"
+
+GpuCounter::GpuCounter()
+{
+	glGenBuffers(1, &counterBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+
+	glGenBuffers(GPU_COUNTER_READBACK_COUNT, readbackBuffers);
+	for (int i = 0; i < GPU_COUNTER_READBACK_COUNT; i++)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, readbackBuffers[i]);
+		glBufferData(GL_COPY_WRITE_BUFFER, sizeof(GLuint), nullptr, GL_STREAM_READ);
+		fences[i] = nullptr;
+	}
+	current = 0;
+	pending = 0;
+	value = -1;
+}
+
+void GpuCounter::Begin()
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+}
+
+void GpuCounter::End()
+{
+	// all copies still in flight, drop the oldest result
+	if (pending == GPU_COUNTER_READBACK_COUNT)
+	{
+		int oldest = (current - pending + GPU_COUNTER_READBACK_COUNT) % GPU_COUNTER_READBACK_COUNT;
+		glDeleteSync(fences[oldest]);
+		fences[oldest] = nullptr;
+		pending--;
+	}
+
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_COPY_READ_BUFFER, counterBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, readbackBuffers[current]);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GLuint));
+	fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	current = (current + 1) % GPU_COUNTER_READBACK_COUNT;
+	pending++;
+}
+
+long long GpuCounter::GetValue()
+{
+	while (pending > 0)
+	{
+		int oldest = (current - pending + GPU_COUNTER_READBACK_COUNT) % GPU_COUNTER_READBACK_COUNT;
+
+		GLenum status = glClientWaitSync(fences[oldest], 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+
+		GLuint count = 0;
+		glBindBuffer(GL_COPY_WRITE_BUFFER, readbackBuffers[oldest]);
+		glGetBufferSubData(GL_COPY_WRITE_BUFFER, 0, sizeof(GLuint), &count);
+		value = count;
+
+		glDeleteSync(fences[oldest]);
+		fences[oldest] = nullptr;
+		pending--;
+	}
+	return value;
+}
+
+void GpuCounter::Delete()
+{
+	for (GLsync& fence : fences)
+	{
+		if (fence)
+			glDeleteSync(fence);
+		fence = nullptr;
+	}
+	glDeleteBuffers(1, &counterBuffer);
+	glDeleteBuffers(GPU_COUNTER_READBACK_COUNT, readbackBuffers);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <glad/glad.h>
+
+#define GPU_COUNTER_READBACK_COUNT 4
+
+// a uint in a storage buffer that shaders atomicAdd to between Begin and End. every count is copied into
+// a ring of readback buffers, so like GpuTimer reading a result never waits for the frame that was just submitted
+class GpuCounter
+{
+public:
+	GpuCounter();
+	// zeroes the counter, counterBuffer is bound by the caller to the storage block the shaders add to
+	void Begin();
+	void End();
+	// newest finished count, -1 before the first one is available
+	long long GetValue();
+	void Delete();
+public:
+	unsigned int counterBuffer;
+	unsigned int readbackBuffers[GPU_COUNTER_READBACK_COUNT];
+	GLsync fences[GPU_COUNTER_READBACK_COUNT];
+	int current;
+	int pending;
+	long long value;
+};
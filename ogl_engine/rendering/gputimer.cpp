@@ -0,0 +1,49 @@
+#include "gputimer.h"
+
+GpuTimer::GpuTimer()
+{
+	glGenQueries(GPU_TIMER_QUERY_COUNT, ids);
+	current = 0;
+	pending = 0;
+	milliseconds = -1.0;
+}
+
+void GpuTimer::Begin()
+{
+	// all queries still in flight, drop the oldest result
+	if (pending == GPU_TIMER_QUERY_COUNT)
+		pending--;
+
+	glBeginQuery(GL_TIME_ELAPSED, ids[current]);
+}
+
+void GpuTimer::End()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	current = (current + 1) % GPU_TIMER_QUERY_COUNT;
+	pending++;
+}
+
+double GpuTimer::GetMilliseconds()
+{
+	while (pending > 0)
+	{
+		int oldest = (current - pending + GPU_TIMER_QUERY_COUNT) % GPU_TIMER_QUERY_COUNT;
+
+		GLint available = 0;
+		glGetQueryObjectiv(ids[oldest], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(ids[oldest], GL_QUERY_RESULT, &nanoseconds);
+		milliseconds = nanoseconds / 1e6;
+		pending--;
+	}
+	return milliseconds;
+}
+
+void GpuTimer::Delete()
+{
+	glDeleteQueries(GPU_TIMER_QUERY_COUNT, ids);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <glad/glad.h>
+
+#define GPU_TIMER_QUERY_COUNT 4
+
+// measures gpu time between Begin and End with a ring of timer queries,
+// so reading a result never waits for the frame that was just submitted
+class GpuTimer
+{
+public:
+	GpuTimer();
+	void Begin();
+	void End();
+	// newest finished measurement in milliseconds, -1 before the first one is available
+	double GetMilliseconds();
+	void Delete();
+public:
+	unsigned int ids[GPU_TIMER_QUERY_COUNT];
+	int current;
+	int pending;
+	double milliseconds;
+};
@@ -1,58 +1,277 @@
 #include "shader.h"
+#include <GLFW/glfw3.h>
+
+#include <vector>
+#include <chrono>
+#include <iomanip>
+#include <filesystem>
+#include <cstring>
+
+struct ProgramCacheHeader
+{
+    uint32_t magic;
+    uint32_t format;
+    uint64_t key;
+};
+
+static uint64_t HashString(const std::string& text, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    for (unsigned char c : text)
+    {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// binaries only load on the driver that wrote them, so the driver is hashed after the sources
+static uint64_t ProgramCacheKey(uint64_t sourceHash)
+{
+    uint64_t hash = HashString((const char*)glGetString(GL_VENDOR), sourceHash);
+    hash = HashString((const char*)glGetString(GL_RENDERER), hash);
+    return HashString((const char*)glGetString(GL_VERSION), hash);
+}
+
+static std::filesystem::path ProgramCachePath(uint64_t key)
+{
+    std::stringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << key << ".program";
+    return std::filesystem::path(PROGRAM_CACHE_DIRECTORY) / name.str();
+}
+
+// name of a program resource without the [0] of arrays
+static std::string ResourceName(uint32_t program, GLenum programInterface, int32_t index, int32_t length)
+{
+    std::string name(length, '\0');
+    glGetProgramResourceName(program, programInterface, index, length, NULL, &name[0]);
+    name.resize(name.find('\0'));
+    if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+        name.resize(name.size() - 3);
+    return name;
+}
+
+bool Shader::parallelCompile = false;
+
+bool Shader::EnableParallelCompile()
+{
+    // glad is generated without these extensions, so the entry point is loaded here
+    typedef void (APIENTRYP MaxShaderCompilerThreadsProc)(GLuint count);
+    const char* extensions[][2] = {
+        { "GL_KHR_parallel_shader_compile", "glMaxShaderCompilerThreadsKHR" },
+        { "GL_ARB_parallel_shader_compile", "glMaxShaderCompilerThreadsARB" }
+    };
+    for (auto& extension : extensions)
+    {
+        if (!glfwExtensionSupported(extension[0]))
+            continue;
+        MaxShaderCompilerThreadsProc maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc)glfwGetProcAddress(extension[1]);
+        if (maxShaderCompilerThreads == NULL)
+            continue;
+        // let the driver pick the thread count
+        maxShaderCompilerThreads(0xffffffff);
+        parallelCompile = true;
+        std::cout << "using " << extension[0] << "\n";
+        return true;
+    }
+    return false;
+}
+
+// reads a shader file and pastes the file of every #include "name" line in its place, relative to the including file
+static std::string ReadShaderSource(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << path << std::endl;
+        return "";
+    }
+
+    std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+    std::string source;
+    for (std::string line; std::getline(file, line);)
+    {
+        size_t start = line.find_first_not_of(" \t");
+        if (start != std::string::npos && line.compare(start, 10, "#include \"") == 0)
+        {
+            size_t end = line.find('"', start + 10);
+            source += ReadShaderSource(directory + line.substr(start + 10, end - start - 10));
+        }
+        else
+        {
+            source += line + "\n";
+        }
+    }
+    return source;
+}
+
+static const char* StageName(GLenum type)
+{
+    switch (type)
+    {
+    case GL_VERTEX_SHADER: return "VERTEX";
+    case GL_FRAGMENT_SHADER: return "FRAGMENT";
+    default: return "COMPUTE";
+    }
+}
+
+Shader::Shader(const char* vertexPath, const char* fragmentPath, const std::string& defines, bool async)
+{
+    Load({ { GL_VERTEX_SHADER, vertexPath }, { GL_FRAGMENT_SHADER, fragmentPath } }, defines, async);
+}
+
+Shader Shader::Compute(const char* computePath, const std::string& defines, bool async)
+{
+    Shader shader;
+    shader.Load({ { GL_COMPUTE_SHADER, computePath } }, defines, async);
+    return shader;
+}
+
+void Shader::Load(const std::vector<Stage>& stages, const std::string& defines, bool async)
+{
+    // the last stage names the program in messages
+    path = stages.back().path;
+    pending = false;
+    compileStart = std::chrono::steady_clock::now();
+
+    std::vector<std::string> sources;
+    programKey = 0xcbf29ce484222325ull;
+    for (auto& stage : stages)
+    {
+        std::string source = ReadShaderSource(stage.path);
+        // #version has to stay the first line
+        if (!defines.empty())
+            source.insert(source.find('\n') + 1, defines);
+        programKey = HashString(source, programKey);
+        sources.push_back(source);
+    }
+    programKey = ProgramCacheKey(programKey);
+
+    if (LoadProgramBinary(programKey))
+    {
+        std::chrono::duration<double, std::milli> loadTime = std::chrono::steady_clock::now() - compileStart;
+        std::cout << "loaded program binary for " << path << ": " << loadTime.count() << " ms\n";
+        linked = true;
+        Reflect();
+        return;
+    }
 
-Shader::Shader(const char* vertexPath, const char* fragmentPath)
-{
-    // 1. retrieve the vertex/fragment source code from filePath
-    std::string vertexCode;
-    std::string fragmentCode;
-    std::ifstream vShaderFile;
-    std::ifstream fShaderFile;
-    // ensure ifstream objects can throw exceptions:
-    vShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    fShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    try
-    {
-        // open files
-        vShaderFile.open(vertexPath);
-        fShaderFile.open(fragmentPath);
-        std::stringstream vShaderStream, fShaderStream;
-        // read file's buffer contents into streams
-        vShaderStream << vShaderFile.rdbuf();
-        fShaderStream << fShaderFile.rdbuf();
-        // close file handlers
-        vShaderFile.close();
-        fShaderFile.close();
-        // convert stream into string
-        vertexCode = vShaderStream.str();
-        fragmentCode = fShaderStream.str();
-    }
-    catch (std::ifstream::failure& e)
-    {
-        std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
-    }
-    const char* vShaderCode = vertexCode.c_str();
-    const char* fShaderCode = fragmentCode.c_str();
-    // 2. compile shaders
-    uint32_t vertex, fragment;
-    // vertex shader
-    vertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex, 1, &vShaderCode, NULL);
-    glCompileShader(vertex);
-    CheckCompileErrors(vertex, "VERTEX");
-    // fragment Shader
-    fragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment, 1, &fShaderCode, NULL);
-    glCompileShader(fragment);
-    CheckCompileErrors(fragment, "FRAGMENT");
-    // shader Program
     id = glCreateProgram();
-    glAttachShader(id, vertex);
-    glAttachShader(id, fragment);
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        const char* code = sources[i].c_str();
+        uint32_t shader = glCreateShader(stages[i].type);
+        glShaderSource(shader, 1, &code, NULL);
+        glCompileShader(shader);
+        glAttachShader(id, shader);
+        stageShaders.push_back({ stages[i].type, shader });
+    }
+    glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(id);
+
+    // any status query waits for the compiler, so async programs are finished by IsReady
+    pending = true;
+    if (!async)
+        FinishCompile();
+}
+
+bool Shader::IsReady()
+{
+    if (!pending)
+        return true;
+
+    if (parallelCompile)
+    {
+        int completed;
+        glGetProgramiv(id, GL_COMPLETION_STATUS_KHR, &completed);
+        if (!completed)
+            return false;
+    }
+    FinishCompile();
+    return true;
+}
+
+bool Shader::IsLinked() const
+{
+    return linked;
+}
+
+void Shader::FinishCompile()
+{
+    for (auto& stage : stageShaders)
+        CheckCompileErrors(stage.shader, StageName(stage.type));
     CheckCompileErrors(id, "PROGRAM");
     // delete the shaders as they're linked into our program now and no longer necessary
-    glDeleteShader(vertex);
-    glDeleteShader(fragment);
+    for (auto& stage : stageShaders)
+        glDeleteShader(stage.shader);
+    stageShaders.clear();
+    pending = false;
+
+    int status;
+    glGetProgramiv(id, GL_LINK_STATUS, &status);
+    linked = status != 0;
+    if (linked)
+        SaveProgramBinary(programKey);
+
+    std::chrono::duration<double, std::milli> compileTime = std::chrono::steady_clock::now() - compileStart;
+    std::cout << "compiled " << path << ": " << compileTime.count() << " ms\n";
+    Reflect();
+}
+
+bool Shader::LoadProgramBinary(uint64_t key)
+{
+    std::ifstream file(ProgramCachePath(key), std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return false;
+
+    std::vector<char> bytes((size_t)file.tellg());
+    file.seekg(0);
+    if (bytes.size() <= sizeof(ProgramCacheHeader) || !file.read(bytes.data(), bytes.size()))
+        return false;
+
+    ProgramCacheHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (header.magic != PROGRAM_CACHE_MAGIC || header.key != key)
+        return false;
+
+    id = glCreateProgram();
+    glProgramBinary(id, header.format, bytes.data() + sizeof(header), (GLsizei)(bytes.size() - sizeof(header)));
+
+    // the driver rejects binaries it can't use, e.g. after an update that kept the version string
+    int status;
+    glGetProgramiv(id, GL_LINK_STATUS, &status);
+    if (!status)
+    {
+        std::cout << "ignoring stale program binary for " << path << "\n";
+        glDeleteProgram(id);
+        return false;
+    }
+    return true;
+}
+
+void Shader::SaveProgramBinary(uint64_t key)
+{
+    int formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    int length = 0;
+    glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (formatCount == 0 || length == 0)
+        return;
+
+    ProgramCacheHeader header = { PROGRAM_CACHE_MAGIC, 0, key };
+    std::vector<char> binary(length);
+    glGetProgramBinary(id, length, NULL, &header.format, binary.data());
+
+    std::error_code error;
+    std::filesystem::create_directories(PROGRAM_CACHE_DIRECTORY, error);
+
+    std::ofstream file(ProgramCachePath(key), std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cout << "error saving program binary for " << path << "\n";
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write(binary.data(), binary.size());
 }
 
 void Shader::Bind()
@@ -65,6 +284,15 @@ void Shader::Unbind()
     glUseProgram(0);
 }
 
+void Shader::Delete()
+{
+    for (auto& stage : stageShaders)
+        glDeleteShader(stage.shader);
+    stageShaders.clear();
+    pending = false;
+    glDeleteProgram(id);
+}
+
 void Shader::CheckCompileErrors(unsigned int shader, std::string type)
 {
     int success;
@@ -91,51 +319,122 @@ void Shader::CheckCompileErrors(unsigned int shader, std::string type)
     }
 }
 
-void Shader::SetUInt(const std::string& name, uint32_t value) const
+void Shader::Reflect()
+{
+    uniforms.clear();
+    uniformBlocks.clear();
+    storageBlocks.clear();
+
+    int32_t count = 0;
+    glGetProgramInterfaceiv(id, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+    const GLenum uniformProperties[] = { GL_BLOCK_INDEX, GL_LOCATION, GL_NAME_LENGTH };
+    for (int32_t i = 0; i < count; i++)
+    {
+        int32_t values[3];
+        glGetProgramResourceiv(id, GL_UNIFORM, i, 3, uniformProperties, 3, NULL, values);
+        // members of uniform and storage blocks have no location of their own
+        if (values[0] != -1)
+            continue;
+        uniforms[ResourceName(id, GL_UNIFORM, i, values[2])] = values[1];
+    }
+
+    const GLenum blockProperties[] = { GL_BUFFER_BINDING, GL_NAME_LENGTH };
+    glGetProgramInterfaceiv(id, GL_UNIFORM_BLOCK, GL_ACTIVE_RESOURCES, &count);
+    for (int32_t i = 0; i < count; i++)
+    {
+        int32_t values[2];
+        glGetProgramResourceiv(id, GL_UNIFORM_BLOCK, i, 2, blockProperties, 2, NULL, values);
+        uniformBlocks[ResourceName(id, GL_UNIFORM_BLOCK, i, values[1])] = values[0];
+    }
+
+    glGetProgramInterfaceiv(id, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &count);
+    for (int32_t i = 0; i < count; i++)
+    {
+        int32_t values[2];
+        glGetProgramResourceiv(id, GL_SHADER_STORAGE_BLOCK, i, 2, blockProperties, 2, NULL, values);
+        storageBlocks[ResourceName(id, GL_SHADER_STORAGE_BLOCK, i, values[1])] = values[0];
+    }
+}
+
+UniformHandle Shader::Uniform(const std::string& name) const
+{
+    UniformHandle uniform;
+    auto it = uniforms.find(name);
+    if (it != uniforms.end())
+        uniform.location = it->second;
+    else
+        std::cout << "WARNING::SHADER::UNIFORM_NOT_ACTIVE: " << name << " in " << path << std::endl;
+    return uniform;
+}
+
+BlockHandle Shader::UniformBlock(const std::string& name) const
+{
+    BlockHandle block;
+    auto it = uniformBlocks.find(name);
+    if (it != uniformBlocks.end())
+        block.binding = it->second;
+    else
+        std::cout << "WARNING::SHADER::UNIFORM_BLOCK_NOT_ACTIVE: " << name << " in " << path << std::endl;
+    return block;
+}
+
+BlockHandle Shader::StorageBlock(const std::string& name) const
+{
+    BlockHandle block;
+    auto it = storageBlocks.find(name);
+    if (it != storageBlocks.end())
+        block.binding = it->second;
+    return block;
+}
+
+void Shader::BindStorageBuffers(const std::vector<StorageBuffer>& buffers) const
+{
+    for (auto& buffer : buffers)
+    {
+        BlockHandle block = StorageBlock(buffer.block);
+        if (block.binding != -1)
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, block.binding, buffer.buffer);
+    }
+}
+
+// glUniform ignores location -1, so a missing uniform that was already reported is a no-op here
+void Shader::SetUInt(UniformHandle uniform, uint32_t value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform1ui(location, value);
+    glUniform1ui(uniform.location, value);
 }
 
-void Shader::SetInt(const std::string& name, int value) const
+void Shader::SetInt(UniformHandle uniform, int value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform1i(location, value);
+    glUniform1i(uniform.location, value);
 }
 
-void Shader::SetInt2(const std::string& name, glm::ivec2 value) const
+void Shader::SetInt2(UniformHandle uniform, glm::ivec2 value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform2i(location, value.x, value.y);
+    glUniform2i(uniform.location, value.x, value.y);
 }
 
-void Shader::SetInt3(const std::string& name, glm::ivec3 value) const
+void Shader::SetInt3(UniformHandle uniform, glm::ivec3 value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform3i(location, value.x, value.y, value.z);
+    glUniform3i(uniform.location, value.x, value.y, value.z);
 }
 
 
-void Shader::SetFloat(const std::string& name, float value) const
+void Shader::SetFloat(UniformHandle uniform, float value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform1f(location, value);
+    glUniform1f(uniform.location, value);
 }
 
-void Shader::SetFloat2(const std::string& name, glm::vec2 value) const
+void Shader::SetFloat2(UniformHandle uniform, glm::vec2 value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform2f(location, value.x, value.y);
+    glUniform2f(uniform.location, value.x, value.y);
 }
 
-void Shader::SetFloat3(const std::string& name, glm::vec3 value) const
+void Shader::SetFloat3(UniformHandle uniform, glm::vec3 value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform3f(location, value.x, value.y, value.z);
+    glUniform3f(uniform.location, value.x, value.y, value.z);
 }
 
-void Shader::SetFloat4(const std::string& name, glm::vec4 value) const
+void Shader::SetFloat4(UniformHandle uniform, glm::vec4 value) const
 {
-    int32_t location = glGetUniformLocation(id, name.c_str());
-    glUniform4f(location, value.x, value.y, value.z, value.w);
+    glUniform4f(uniform.location, value.x, value.y, value.z, value.w);
 }
@@ -8,22 +8,104 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <chrono>
+
+// linked programs are stored as <key>.program in this directory, the key hashes both sources and the driver
+#define PROGRAM_CACHE_DIRECTORY "cache"
+#define PROGRAM_CACHE_MAGIC 0x474f5250		// "PROG"
+
+// GL_KHR_parallel_shader_compile and GL_ARB_parallel_shader_compile share these values
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+
+// handles are looked up once after loading and kept by the caller, -1 when the program has no such resource
+struct UniformHandle
+{
+    int32_t location = -1;
+};
+
+struct BlockHandle
+{
+    int32_t binding = -1;
+};
+
+// a buffer for the storage block with that name
+struct StorageBuffer
+{
+    std::string block;
+    uint32_t buffer;
+};
 
 class Shader
 {
 public:
-    Shader(const char* vertexPath, const char* fragmentPath);
+    // defines are inserted after the #version line of every stage, e.g. "#define NAME\n",
+    // and #include "file" lines are replaced by the file. an async shader returns before the driver is done,
+    // poll IsReady before using it
+    Shader(const char* vertexPath, const char* fragmentPath, const std::string& defines = "", bool async = false);
+    static Shader Compute(const char* computePath, const std::string& defines = "", bool async = false);
+    // compiles in driver threads when the context supports it, call once after loading gl.
+    // false when it doesn't, async shaders then finish compiling on their first IsReady
+    static bool EnableParallelCompile();
+    // true once compiling and linking has finished, successfully or not
+    bool IsReady();
+    bool IsLinked() const;
     void Bind();
     void Unbind();
+    void Delete();
     void CheckCompileErrors(unsigned int shader, std::string type);
-    void SetUInt(const std::string& name, uint32_t value) const;
-    void SetInt(const std::string& name, int value) const;
-    void SetInt2(const std::string& name, glm::ivec2 value) const;
-    void SetInt3(const std::string& name, glm::ivec3 value) const;
-    void SetFloat(const std::string& name, float value) const;
-    void SetFloat2(const std::string& name, glm::vec2 value) const;
-    void SetFloat3(const std::string& name, glm::vec3 value) const;
-    void SetFloat4(const std::string& name, glm::vec4 value) const;
+    // missing names are reported here, so call these at load time and not every frame
+    UniformHandle Uniform(const std::string& name) const;
+    BlockHandle UniformBlock(const std::string& name) const;
+    // programs sharing a set of storage blocks each use only some of them, so a missing block isn't reported
+    BlockHandle StorageBlock(const std::string& name) const;
+    // binds every buffer whose block the program uses to the binding the program declares for it
+    void BindStorageBuffers(const std::vector<StorageBuffer>& buffers) const;
+    void SetUInt(UniformHandle uniform, uint32_t value) const;
+    void SetInt(UniformHandle uniform, int value) const;
+    void SetInt2(UniformHandle uniform, glm::ivec2 value) const;
+    void SetInt3(UniformHandle uniform, glm::ivec3 value) const;
+    void SetFloat(UniformHandle uniform, float value) const;
+    void SetFloat2(UniformHandle uniform, glm::vec2 value) const;
+    void SetFloat3(UniformHandle uniform, glm::vec3 value) const;
+    void SetFloat4(UniformHandle uniform, glm::vec4 value) const;
 private:
+    struct Stage
+    {
+        GLenum type;
+        const char* path;
+    };
+    struct StageShader
+    {
+        GLenum type;
+        uint32_t shader;
+    };
+
+    Shader() = default;
+    void Load(const std::vector<Stage>& stages, const std::string& defines, bool async);
+    // false when there's no usable binary for key, the program is then compiled from source
+    bool LoadProgramBinary(uint64_t key);
+    void SaveProgramBinary(uint64_t key);
+    // reports errors, caches the binary and reflects the program once linking is done
+    void FinishCompile();
+    // fills the maps below from the linked program
+    void Reflect();
+
 	uint32_t id;
+    // of the last stage, for messages
+    std::string path;
+    bool linked = false;
+    // shaders of a program whose link may still be running
+    bool pending = false;
+    std::vector<StageShader> stageShaders;
+    uint64_t programKey = 0;
+    std::chrono::steady_clock::time_point compileStart;
+
+    static bool parallelCompile;
+    // uniform locations outside of blocks and block bindings by name, arrays by their name without [0]
+    std::unordered_map<std::string, int32_t> uniforms;
+    std::unordered_map<std::string, int32_t> uniformBlocks;
+    std::unordered_map<std::string, int32_t> storageBlocks;
 };
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include "shadervariants.h"
+
+ShaderVariants::ShaderVariants(const char* vertexPath, const char* fragmentPath, size_t capacity)
+	: vertexPath(vertexPath), fragmentPath(fragmentPath), capacity(capacity)
+{
+}
+
+ShaderVariants::ShaderVariants(const char* computePath, size_t capacity)
+	: computePath(computePath), capacity(capacity)
+{
+}
+
+Shader& ShaderVariants::Get(const std::string& defines, Shader& fallback)
+{
+	for (auto it = variants.begin(); it != variants.end(); it++)
+	{
+		if (it->defines != defines)
+			continue;
+
+		variants.splice(variants.begin(), variants, it);
+		Shader& shader = variants.front().shader;
+		return shader.IsReady() && shader.IsLinked() ? shader : fallback;
+	}
+
+	// one compile at a time, so switching settings quickly doesn't queue up programs that are never used
+	if (IsCompiling())
+		return fallback;
+
+	if (computePath.empty())
+		variants.push_front({ defines, Shader(vertexPath.c_str(), fragmentPath.c_str(), defines, true) });
+	else
+		variants.push_front({ defines, Shader::Compute(computePath.c_str(), defines, true) });
+	while (variants.size() > capacity)
+	{
+		variants.back().shader.Delete();
+		variants.pop_back();
+	}
+	return fallback;
+}
+
+bool ShaderVariants::IsCompiling()
+{
+	for (auto& variant : variants)
+	{
+		if (!variant.shader.IsReady())
+			return true;
+	}
+	return false;
+}
+
+void ShaderVariants::Delete()
+{
+	for (auto& variant : variants)
+		variant.shader.Delete();
+	variants.clear();
+}
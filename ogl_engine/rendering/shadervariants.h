@@ -0,0 +1,33 @@
+#pragma once
+#include "shader.h"
+#include <list>
+
+// specializations of one shader keyed by the #define block injected into its source.
+// a missing variant is compiled in the background while the caller keeps drawing with its generic program,
+// and linked variants are kept in a least recently used list of at most capacity programs
+class ShaderVariants
+{
+public:
+	ShaderVariants(const char* vertexPath, const char* fragmentPath, size_t capacity);
+	// variants of a compute shader
+	ShaderVariants(const char* computePath, size_t capacity);
+	// the variant for defines once it's linked, fallback until then
+	Shader& Get(const std::string& defines, Shader& fallback);
+	// true while a variant is compiling
+	bool IsCompiling();
+	void Delete();
+public:
+	struct Variant
+	{
+		std::string defines;
+		Shader shader;
+	};
+
+	// computePath is empty for vertex and fragment shaders and the others for compute shaders
+	std::string vertexPath;
+	std::string fragmentPath;
+	std::string computePath;
+	size_t capacity;
+	// most recently used first
+	std::list<Variant> variants;
+};
@@ -0,0 +1,105 @@
+#include "uploadring.h"
+#include <cstring>
+
+UploadRing::UploadRing(GLsizeiptr frameSize)
+	: frameSize(frameSize)
+{
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	glGenBuffers(1, &id);
+	glBindBuffer(GL_COPY_READ_BUFFER, id);
+	glBufferStorage(GL_COPY_READ_BUFFER, frameSize * UPLOAD_RING_FRAMES, nullptr, flags);
+	mapped = (char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, frameSize * UPLOAD_RING_FRAMES, flags);
+
+	region = 0;
+	head = 0;
+	for (int i = 0; i < UPLOAD_RING_FRAMES; i++)
+		fences[i] = nullptr;
+}
+
+void UploadRing::Write(GLuint buffer, GLintptr offset, GLsizeiptr size, const void* data)
+{
+	if (size <= 0)
+		return;
+
+	// bytes written again before a flush go over the pending ones
+	for (auto& copy : copies)
+	{
+		if (copy.buffer == buffer && copy.offset <= offset && offset + size <= copy.offset + copy.size)
+		{
+			memcpy(mapped + copy.source + (offset - copy.offset), data, size);
+			return;
+		}
+	}
+
+	// too big for a region, goes directly after everything that was written before it
+	if (size > frameSize)
+	{
+		Flush();
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+		return;
+	}
+
+	if (head + size > frameSize)
+		Flush();
+
+	GLintptr source = region * frameSize + head;
+	memcpy(mapped + source, data, size);
+	head += size;
+
+	// neighbouring writes become one copy
+	if (!copies.empty())
+	{
+		Copy& last = copies.back();
+		if (last.buffer == buffer && last.offset + last.size == offset && last.source + last.size == source)
+		{
+			last.size += size;
+			return;
+		}
+	}
+	copies.push_back({ buffer, offset, source, size });
+}
+
+void UploadRing::Flush()
+{
+	if (copies.empty())
+		return;
+
+	glBindBuffer(GL_COPY_READ_BUFFER, id);
+	for (auto& copy : copies)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, copy.buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, copy.source, copy.offset, copy.size);
+	}
+	copies.clear();
+
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	region = (region + 1) % UPLOAD_RING_FRAMES;
+	head = 0;
+	WaitForRegion();
+}
+
+// only blocks when the gpu is more than UPLOAD_RING_FRAMES flushes behind
+void UploadRing::WaitForRegion()
+{
+	if (!fences[region])
+		return;
+
+	while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+		;
+	glDeleteSync(fences[region]);
+	fences[region] = nullptr;
+}
+
+void UploadRing::Delete()
+{
+	for (int i = 0; i < UPLOAD_RING_FRAMES; i++)
+	{
+		if (fences[i])
+			glDeleteSync(fences[i]);
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, id);
+	glUnmapBuffer(GL_COPY_READ_BUFFER);
+	glDeleteBuffers(1, &id);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <glad/glad.h>
+#include <vector>
+
+#define UPLOAD_RING_FRAMES 3
+
+// staging memory for small buffer updates: one persistently mapped buffer split into a region per frame in flight.
+// writes are copied into the current region and turned into gpu side copies by Flush, so the cpu never
+// touches a buffer the gpu may still be reading. a region is reused once the fence of its last flush has passed
+class UploadRing
+{
+public:
+	UploadRing(GLsizeiptr frameSize);
+	// copies size bytes of data to offset in buffer when the ring is flushed
+	void Write(GLuint buffer, GLintptr offset, GLsizeiptr size, const void* data);
+	// issues the copies written since the last flush and moves on to the next region
+	void Flush();
+	void Delete();
+private:
+	void WaitForRegion();
+public:
+	// a dirty range of a target buffer and where its bytes are in the ring
+	struct Copy
+	{
+		GLuint buffer;
+		GLintptr offset;
+		GLintptr source;
+		GLsizeiptr size;
+	};
+
+	unsigned int id;
+	char* mapped;
+	GLsizeiptr frameSize;
+	int region;
+	GLsizeiptr head;
+	GLsync fences[UPLOAD_RING_FRAMES];
+	std::vector<Copy> copies;
+};
@@ -0,0 +1,138 @@
+#include "wavefront.h"
+
+// sizes of PathState, PathHit and a radiance entry in wavefront.glsl
+#define PATH_STATE_SIZE 48
+#define PATH_HIT_SIZE 32
+#define RADIANCE_SIZE 16
+// dispatch arguments and the two queue counters
+#define QUEUE_STATE_SIZE 20
+
+WavefrontTracer::WavefrontTracer()
+	: pathCapacity(0), pixelCapacity(0)
+{
+	glGenBuffers(2, pathBuffers);
+	glGenBuffers(1, &hitBuffer);
+	glGenBuffers(1, &radianceBuffer);
+	glGenBuffers(1, &queueBuffer);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, queueBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, QUEUE_STATE_SIZE, nullptr, GL_DYNAMIC_DRAW);
+}
+
+void WavefrontTracer::Build(const std::string& defines)
+{
+	for (auto& kernel : kernels)
+		kernel.Delete();
+	kernels.clear();
+
+	const char* paths[KERNEL_COUNT] = {
+		"shaders/wavefrontGenerate.comp",
+		"shaders/wavefrontSchedule.comp",
+		"shaders/wavefrontExtend.comp",
+		"shaders/wavefrontShade.comp",
+		"shaders/wavefrontResolve.comp"
+	};
+	for (int i = 0; i < KERNEL_COUNT; i++)
+		kernels.push_back(Shader::Compute(paths[i], defines));
+
+	sampleIndex = kernels[GENERATE].Uniform("sample_index");
+	imageSize = kernels[GENERATE].Uniform("image_size");
+	scheduleBounce = kernels[SCHEDULE].Uniform("bounce");
+	shadeBounce = kernels[SHADE].Uniform("bounce");
+	this->defines = defines;
+}
+
+void WavefrontTracer::Reserve(GLsizeiptr pathCount, GLsizeiptr pixelCount)
+{
+	if (pathCount > pathCapacity)
+	{
+		pathCapacity = pathCount;
+		for (int i = 0; i < 2; i++)
+		{
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, pathBuffers[i]);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, pathCapacity * PATH_STATE_SIZE, nullptr, GL_DYNAMIC_DRAW);
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, hitBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, pathCapacity * PATH_HIT_SIZE, nullptr, GL_DYNAMIC_DRAW);
+	}
+	if (pixelCount > pixelCapacity)
+	{
+		pixelCapacity = pixelCount;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, radianceBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, pixelCapacity * RADIANCE_SIZE, nullptr, GL_DYNAMIC_DRAW);
+	}
+}
+
+void WavefrontTracer::Trace(const std::string& defines, const std::vector<StorageBuffer>& sceneBuffers, GLuint image, GLuint momentsImage, int width, int height, int samplesPerPixel, int bounces)
+{
+	if (kernels.empty() || defines != this->defines)
+		Build(defines);
+
+	// each kernel uses a different part of the scene
+	for (auto& kernel : kernels)
+		kernel.BindStorageBuffers(sceneBuffers);
+
+	// at most one path per pixel is alive at a time
+	Reserve((GLsizeiptr)width * height, (GLsizeiptr)width * height);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WAVEFRONT_HIT_BINDING, hitBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WAVEFRONT_RADIANCE_BINDING, radianceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WAVEFRONT_QUEUE_BINDING, queueBuffer);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, queueBuffer);
+	glBindImageTexture(2, momentsImage, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, radianceBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RGBA32F, GL_RGBA, GL_FLOAT, nullptr);
+
+	for (int sample = 0; sample < samplesPerPixel; sample++)
+	{
+		// the previous sample's kernels are done with the counters before they're reset
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, queueBuffer);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WAVEFRONT_PATHS_OUT_BINDING, pathBuffers[0]);
+		kernels[GENERATE].Bind();
+		kernels[GENERATE].SetInt(sampleIndex, sample);
+		kernels[GENERATE].SetInt2(imageSize, glm::ivec2(width, height));
+		glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+
+		for (int bounce = 0; bounce <= bounces; bounce++)
+		{
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			kernels[SCHEDULE].Bind();
+			kernels[SCHEDULE].SetInt(scheduleBounce, bounce);
+			glDispatchCompute(1, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WAVEFRONT_PATHS_IN_BINDING, pathBuffers[bounce % 2]);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WAVEFRONT_PATHS_OUT_BINDING, pathBuffers[(bounce + 1) % 2]);
+
+			kernels[EXTEND].Bind();
+			glDispatchComputeIndirect(0);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+			kernels[SHADE].Bind();
+			kernels[SHADE].SetInt(shadeBounce, bounce);
+			glDispatchComputeIndirect(0);
+		}
+	}
+
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	kernels[RESOLVE].Bind();
+	glBindImageTexture(0, image, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+	glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+	// the next passes sample the images and the next frame loads them again
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+
+void WavefrontTracer::Delete()
+{
+	for (auto& kernel : kernels)
+		kernel.Delete();
+	kernels.clear();
+	glDeleteBuffers(2, pathBuffers);
+	glDeleteBuffers(1, &hitBuffer);
+	glDeleteBuffers(1, &radianceBuffer);
+	glDeleteBuffers(1, &queueBuffer);
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <glad/glad.h>
+#include <string>
+#include <vector>
+
+#include "shader.h"
+
+// same values as in wavefront.glsl
+#define WAVEFRONT_GROUP_SIZE 64
+#define WAVEFRONT_PATHS_IN_BINDING 10
+#define WAVEFRONT_PATHS_OUT_BINDING 11
+#define WAVEFRONT_HIT_BINDING 12
+#define WAVEFRONT_RADIANCE_BINDING 13
+#define WAVEFRONT_QUEUE_BINDING 14
+
+// wavefront ray pass: instead of one kernel that runs whole paths, every bounce is a closest hit kernel and a
+// shading kernel over a queue of the paths still alive, so lanes don't idle behind longer paths.
+// FrameParams and the image units of the primary surface, normal and albedo are bound by the caller like for
+// the other ray passes
+class WavefrontTracer
+{
+public:
+	WavefrontTracer();
+	// traces samplesPerPixel paths per pixel that adaptive sampling picks and blends them into image, a width x height
+	// rgba32f texture, and momentsImage, r32f. with temporal_reprojection the color replaces image.
+	// the kernels are built on first use and again when defines change, and bind the scene buffers they use
+	void Trace(const std::string& defines, const std::vector<StorageBuffer>& sceneBuffers, GLuint image, GLuint momentsImage, int width, int height, int samplesPerPixel, int bounces);
+	void Delete();
+private:
+	void Build(const std::string& defines);
+	void Reserve(GLsizeiptr pathCount, GLsizeiptr pixelCount);
+public:
+	enum Kernel
+	{
+		GENERATE,
+		SCHEDULE,
+		EXTEND,
+		SHADE,
+		RESOLVE,
+		KERNEL_COUNT
+	};
+
+	std::vector<Shader> kernels;
+	std::string defines;
+	UniformHandle sampleIndex;
+	UniformHandle imageSize;
+	UniformHandle scheduleBounce;
+	UniformHandle shadeBounce;
+
+	// the paths of a bounce are read from one and the survivors pushed to the other
+	unsigned int pathBuffers[2];
+	unsigned int hitBuffer;
+	unsigned int radianceBuffer;
+	unsigned int queueBuffer;
+	GLsizeiptr pathCapacity;
+	GLsizeiptr pixelCapacity;
+};
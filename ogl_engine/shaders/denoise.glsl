@@ -0,0 +1,37 @@
+// edge stopping shared by the denoiser passes, see Denoiser in rendering/denoiser.h.
+// included after frameparams.glsl
+
+// material colors darker than this are divided out as this, so black surfaces don't blow up
+#define DENOISE_ALBEDO_EPSILON 0.01f
+// pixels with fewer accumulated frames get their variance from their neighbors instead of their moments
+#define DENOISE_SPATIAL_VARIANCE_FRAMES 4.f
+// depth difference, relative to the depth, that halves the weight of a tap about every step pixel
+#define DENOISE_SIGMA_DEPTH 0.05f
+// exponent on the cosine between normals
+#define DENOISE_SIGMA_NORMAL 128.f
+// luminance difference in standard deviations that the weight falls off over
+#define DENOISE_SIGMA_LUMINANCE 4.f
+
+vec3 demodulation_albedo(vec3 albedo)
+{
+    return max(albedo, vec3(DENOISE_ALBEDO_EPSILON));
+}
+
+// 1 when pixel q shows the same surface as pixel p, falling off with depth and normal differences.
+// surfaces are primary_surface values, pixel_distance is how far apart p and q are on screen
+float surface_weight(vec2 surface_p, vec3 normal_p, vec2 surface_q, vec3 normal_q, float pixel_distance)
+{
+    // the sky only blends with the sky and an object only with itself
+    if (surface_p.x == 0.f || surface_q.x == 0.f)
+    {
+        return float(surface_p.x == surface_q.x);
+    }
+    if (surface_p.y != surface_q.y)
+    {
+        return 0.f;
+    }
+
+    float depth_weight = exp(-abs(surface_p.x - surface_q.x) / (DENOISE_SIGMA_DEPTH * surface_p.x * pixel_distance + 0.0001f));
+    float normal_weight = pow(max(dot(normal_p, normal_q), 0.f), DENOISE_SIGMA_NORMAL);
+    return depth_weight * normal_weight;
+}
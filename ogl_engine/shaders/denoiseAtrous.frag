@@ -0,0 +1,83 @@
+#version 460 core
+// one a-trous wavelet iteration of the denoiser: a 5x5 b3 spline kernel with its taps step_size pixels apart.
+// taps are weighted down across surface edges and across luminance differences that are large for the variance,
+// and the variance is filtered along with the color for the next iteration
+layout(location = 0) out vec4 filtered;
+
+// demodulated color with its variance in alpha
+layout(binding = 0) uniform sampler2D illumination;
+layout(binding = 2) uniform sampler2D surface;
+layout(binding = 4) uniform sampler2D normal;
+
+uniform int step_size;
+
+#include "frameparams.glsl"
+#include "denoise.glsl"
+
+const float b3_spline[3] = float[](3.f / 8.f, 1.f / 4.f, 1.f / 16.f);
+
+// the variance of the center blurred by a 3x3 gaussian, a single pixel's estimate is too noisy to steer by
+float filtered_variance(ivec2 pixel, ivec2 size)
+{
+    const float gaussian[2] = float[](1.f / 4.f, 1.f / 8.f);
+    float sum = 0.f;
+    float weight_sum = 0.f;
+    for (int y = -1; y <= 1; y++)
+    {
+        for (int x = -1; x <= 1; x++)
+        {
+            ivec2 q = pixel + ivec2(x, y);
+            if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+            {
+                continue;
+            }
+            float weight = gaussian[abs(x)] * gaussian[abs(y)];
+            sum += texelFetch(illumination, q, 0).a * weight;
+            weight_sum += weight;
+        }
+    }
+    return sum / weight_sum;
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(illumination, 0);
+
+    vec4 center = texelFetch(illumination, pixel, 0);
+    vec2 surface_p = texelFetch(surface, pixel, 0).xy;
+    vec3 normal_p = texelFetch(normal, pixel, 0).xyz;
+    float luminance_p = luminance(center.rgb);
+    // converged pixels have next to no variance and keep their own color
+    float sigma_luminance = DENOISE_SIGMA_LUMINANCE * sqrt(filtered_variance(pixel, size)) + 0.000001f;
+
+    vec3 color_sum = vec3(0);
+    float variance_sum = 0.f;
+    float weight_sum = 0.f;
+    for (int y = -2; y <= 2; y++)
+    {
+        for (int x = -2; x <= 2; x++)
+        {
+            ivec2 q = pixel + ivec2(x, y) * step_size;
+            if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)))
+            {
+                continue;
+            }
+
+            vec4 tap = texelFetch(illumination, q, 0);
+            float tap_distance = length(vec2(x, y)) * float(step_size);
+            float weight = b3_spline[abs(x)] * b3_spline[abs(y)];
+            if (q != pixel)
+            {
+                weight *= surface_weight(surface_p, normal_p, texelFetch(surface, q, 0).xy, texelFetch(normal, q, 0).xyz, tap_distance);
+                weight *= exp(-abs(luminance_p - luminance(tap.rgb)) / sigma_luminance);
+            }
+
+            color_sum += tap.rgb * weight;
+            variance_sum += tap.a * weight * weight;
+            weight_sum += weight;
+        }
+    }
+
+    filtered = vec4(color_sum / weight_sum, variance_sum / (weight_sum * weight_sum));
+}
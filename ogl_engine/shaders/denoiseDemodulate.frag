@@ -0,0 +1,55 @@
+#version 460 core
+// first denoiser pass: divides the primary hit albedo out of the accumulated image so the filter blurs the
+// lighting and not the textures, and estimates the variance of the result for the luminance edge stopping
+layout(location = 0) out vec4 illumination;
+
+layout(binding = 0) uniform sampler2D accumulated;
+layout(binding = 1) uniform sampler2D moments;
+layout(binding = 2) uniform sampler2D surface;
+layout(binding = 3) uniform sampler2D albedo;
+
+#include "frameparams.glsl"
+#include "denoise.glsl"
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(accumulated, 0);
+
+    vec4 color = texelFetch(accumulated, pixel, 0);
+    vec3 pixel_albedo = demodulation_albedo(texelFetch(albedo, pixel, 0).rgb);
+    float frames = max(color.a, 1.f);
+    float mean = luminance(color.rgb);
+
+    // variance of the accumulated mean, every frame is one sample like in accumulated_error
+    float variance = max(texelFetch(moments, pixel, 0).r - mean * mean, 0.f) / frames;
+
+    // a few frames after a reset the moments say next to nothing, the spread of the 5x5 pixels
+    // on the same object stands in for them
+    if (frames < DENOISE_SPATIAL_VARIANCE_FRAMES)
+    {
+        vec2 surface_p = texelFetch(surface, pixel, 0).xy;
+        float sum = 0.f;
+        float sum_squared = 0.f;
+        float count = 0.f;
+        for (int y = -2; y <= 2; y++)
+        {
+            for (int x = -2; x <= 2; x++)
+            {
+                ivec2 q = pixel + ivec2(x, y);
+                if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)) || texelFetch(surface, q, 0).y != surface_p.y)
+                {
+                    continue;
+                }
+                float l = luminance(texelFetch(accumulated, q, 0).rgb);
+                sum += l;
+                sum_squared += l * l;
+                count += 1.f;
+            }
+        }
+        variance = max(sum_squared / count - (sum / count) * (sum / count), 0.f);
+    }
+
+    float albedo_luminance = luminance(pixel_albedo);
+    illumination = vec4(color.rgb / pixel_albedo, variance / (albedo_luminance * albedo_luminance));
+}
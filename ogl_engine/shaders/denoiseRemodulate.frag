@@ -0,0 +1,15 @@
+#version 460 core
+// last denoiser pass, multiplies the albedo that denoiseDemodulate.frag divided out back in
+layout(location = 0) out vec4 FragColor;
+
+layout(binding = 0) uniform sampler2D illumination;
+layout(binding = 3) uniform sampler2D albedo;
+
+#include "frameparams.glsl"
+#include "denoise.glsl"
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    FragColor = vec4(texelFetch(illumination, pixel, 0).rgb * demodulation_albedo(texelFetch(albedo, pixel, 0).rgb), 1.f);
+}
@@ -0,0 +1,151 @@
+// per frame parameters and the camera and accumulation math shared by the ray passes and the second pass.
+// included after #version, see ReadShaderSource in shader.cpp
+
+// same layout as FrameParams in main.cpp
+layout(std140, binding = 0) uniform FrameParams
+{
+    vec3 camera;
+    float focal_length;
+    vec3 sky_color;
+    uint time;
+    vec3 horizont_color;
+    int samples_per_pixel;
+    vec2 camera_rotation;
+    ivec2 resolution;
+    int bounces;
+    // adaptive sampling stops tracing pixels whose accumulated_error is below this, 0 traces every pixel
+    float target_error;
+    int trimesh_count;
+    int sphere_count;
+    int rendered_frames_count;
+    int tile_order;
+    // camera of the previous frame, the accumulated image was rendered from it
+    vec2 previous_camera_rotation;
+    vec3 previous_camera;
+    float previous_focal_length;
+    // when set the ray passes write this frame's color and surface, and the second pass reprojects the
+    // accumulated image to the current camera before blending
+    int temporal_reprojection;
+    // most frames of history a pixel keeps while the camera moves
+    int motion_history;
+    // converged pixels are left alone for good instead of being revisited every ADAPTIVE_REVISIT_FRAMES
+    int stop_at_target_error;
+};
+
+// frames before the error estimate of a pixel is trusted
+#define ADAPTIVE_MIN_FRAMES 16
+// converged pixels are still traced every this many frames unless stop_at_target_error is set,
+// so a pixel that converged on an unlucky estimate gets more samples eventually
+#define ADAPTIVE_REVISIT_FRAMES 8
+// added to the mean so the relative error of nearly black pixels doesn't blow up
+#define ADAPTIVE_DARK_LUMINANCE 0.05f
+
+mat3 camera_rotation_matrix(vec2 rotation)
+{
+    mat3 roty;
+    roty[0] = vec3(cos(rotation.y), 0, sin(rotation.y));
+    roty[1] = vec3(0, 1, 0);
+    roty[2] = vec3(-sin(rotation.y), 0, cos(rotation.y));
+
+    mat3 rotx;
+    rotx[0] = vec3(1, 0, 0);
+    rotx[1] = vec3(0, cos(rotation.x), -sin(rotation.x));
+    rotx[2] = vec3(0, sin(rotation.x), cos(rotation.x));
+
+    return rotx * roty;
+}
+
+vec2 viewport_size()
+{
+    float aspect = float(resolution.x) / float(resolution.y);
+    return vec2(aspect * 2.f, 2.f);
+}
+
+// viewport position of the point frag_coord on screen, 0 .. 1 over the screen
+vec2 screen_uv(vec2 frag_coord)
+{
+    return frag_coord / vec2(resolution - 1);
+}
+
+// direction of the ray through uv for a camera with rotation and focal
+vec3 camera_dir(vec2 uv, vec2 rotation, float focal)
+{
+    return vec3((uv - 0.5f) * viewport_size(), -focal) * camera_rotation_matrix(rotation);
+}
+
+// inverse of camera_dir, directions behind the camera end up outside 0 .. 1
+vec2 camera_uv(vec3 dir, vec2 rotation, float focal)
+{
+    // dir * rotation is transpose(rotation) * dir, so rotation * dir undoes it
+    vec3 d = camera_rotation_matrix(rotation) * dir;
+    if (d.z >= 0.f)
+    {
+        return vec2(-1.f);
+    }
+    return d.xy * (focal / -d.z) / viewport_size() + 0.5f;
+}
+
+// direction of the unjittered ray through pixel. camera rays jitter frag_coord + 0.5 by up to a pixel, so this is
+// the middle of their spread, and the same ray the primary surface is traced along
+vec3 pixel_center_dir(ivec2 pixel, vec2 rotation, float focal)
+{
+    return camera_dir(screen_uv(vec2(pixel) + 1.f), rotation, focal);
+}
+
+bool camera_moved()
+{
+    return camera != previous_camera || camera_rotation != previous_camera_rotation || focal_length != previous_focal_length;
+}
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// frames already blended into an accumulated pixel, kept in its alpha
+float accumulated_frames(vec4 old_color)
+{
+    return rendered_frames_count == 1 ? 0.f : old_color.a;
+}
+
+// running average of history frames of old_color and new_color, alpha counts the frames
+vec4 accumulate(vec4 old_color, vec3 new_color, float history)
+{
+    float frames = history + 1.f;
+    return vec4(mix(old_color.rgb, new_color, 1.f / frames), frames);
+}
+
+// the same running average of the squared luminance, kept next to the color for the error estimate
+float accumulate_moment(float old_moment, vec3 new_color, float history)
+{
+    float l = luminance(new_color);
+    return mix(old_moment, l * l, 1.f / (history + 1.f));
+}
+
+// standard error of the mean luminance of an accumulated pixel relative to that mean, every frame is one sample
+float accumulated_error(vec4 accumulated, float moment)
+{
+    float mean = luminance(accumulated.rgb);
+    float variance = max(moment - mean * mean, 0.f);
+    return sqrt(variance / max(accumulated.a, 1.f)) / (mean + ADAPTIVE_DARK_LUMINANCE);
+}
+
+// the accumulated image only lines up with this frame while the camera stands still
+bool pixel_converged(vec4 accumulated, float moment)
+{
+    return target_error > 0.f && !camera_moved() && accumulated_frames(accumulated) >= ADAPTIVE_MIN_FRAMES
+        && accumulated_error(accumulated, moment) < target_error;
+}
+
+// whether the ray passes trace pixel this frame. the second pass asks again with the same accumulated values,
+// so both agree without passing a mask around
+bool pixel_traced(ivec2 pixel, bool converged)
+{
+    if (!converged)
+    {
+        return true;
+    }
+    // spread over the frames so the revisits don't all land on the same frame
+    uint stagger = uint(pixel.x * 7 + pixel.y * 13);
+    return stop_at_target_error == 0 && (stagger + time) % ADAPTIVE_REVISIT_FRAMES == 0u;
+}
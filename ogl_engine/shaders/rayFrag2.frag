@@ -1,32 +1,112 @@
 #version 460 core
-out vec4 FragColor;
+layout(location = 0) out vec4 FragColor;
+// this frame's surface, kept next to the accumulated color it belongs to for the next frame's reprojection
+layout(location = 1) out vec4 surface;
+// accumulated mean squared luminance for the error estimate of adaptive sampling
+layout(location = 2) out vec4 moments;
 in vec4 color;
 in vec2 uv;
 
 uniform sampler2D tex;
 uniform vec2 tex_size;
 
-uniform sampler2D old_texture;
-uniform sampler2D new_texture;
+layout(binding = 0) uniform sampler2D old_texture;
+layout(binding = 1) uniform sampler2D new_texture;
+// primary_surface of the accumulated image and of this frame, see raycommon.glsl
+layout(binding = 2) uniform sampler2D old_surface;
+layout(binding = 3) uniform sampler2D new_surface;
+// the ray passes read the same texture at the same binding to find the converged pixels
+layout(binding = 5) uniform sampler2D old_moments;
+
+#include "frameparams.glsl"
+
+// a reprojected surface further off than this fraction of its distance is a different surface
+#define DISOCCLUSION_DEPTH_TOLERANCE 0.05f
+// how fast history is dropped when the clamp has to move it, relative to the brightness of the pixel
+#define CLAMP_HISTORY_FALLOFF 4.f
+
+// pixel of the accumulated image that saw the surface at this pixel, false when it wasn't visible there
+bool reproject(ivec2 pixel, vec2 here, out ivec2 old_pixel)
+{
+    vec3 dir = pixel_center_dir(pixel, camera_rotation, focal_length);
+    vec3 p = camera + normalize(dir) * here.x;
+
+    // the sky is infinitely far away, only the rotation moves it
+    vec3 previous_dir = here.x > 0.f ? p - previous_camera : dir;
+    vec2 previous_uv = camera_uv(previous_dir, previous_camera_rotation, previous_focal_length);
+    old_pixel = ivec2(floor(previous_uv * vec2(resolution - 1) - 0.5f));
+
+    if (any(lessThan(old_pixel, ivec2(0))) || any(greaterThanEqual(old_pixel, textureSize(old_surface, 0))))
+    {
+        return false;
+    }
+
+    vec2 there = texelFetch(old_surface, old_pixel, 0).xy;
+    if (here.x == 0.f || there.x == 0.f)
+    {
+        return here.x == there.x;
+    }
+    return here.y == there.y && abs(there.x - length(previous_dir)) < DISOCCLUSION_DEPTH_TOLERANCE * there.x;
+}
+
+// blends the reprojected accumulated color with this frame's while the camera moves. the history is clamped
+// to the colors around the pixel and limited to motion_history frames, so stale light fades out quickly
+vec4 reproject_and_accumulate(ivec2 pixel, vec3 new_color, vec2 here)
+{
+    ivec2 old_pixel;
+    if (!reproject(pixel, here, old_pixel))
+    {
+        moments = vec4(accumulate_moment(0.f, new_color, 0.f));
+        return vec4(new_color, 1.f);
+    }
+
+    vec4 old_color = texelFetch(old_texture, old_pixel, 0);
+    float history = min(accumulated_frames(old_color), float(motion_history));
+
+    vec3 neighborhood_min = new_color;
+    vec3 neighborhood_max = new_color;
+    for (int y = -1; y <= 1; y++)
+    {
+        for (int x = -1; x <= 1; x++)
+        {
+            vec3 neighbor = texelFetch(new_texture, clamp(pixel + ivec2(x, y), ivec2(0), textureSize(new_texture, 0) - 1), 0).rgb;
+            neighborhood_min = min(neighborhood_min, neighbor);
+            neighborhood_max = max(neighborhood_max, neighbor);
+        }
+    }
+    vec3 clamped = clamp(old_color.rgb, neighborhood_min, neighborhood_max);
+    float clamp_amount = luminance(abs(clamped - old_color.rgb)) / (luminance(clamped) + 0.001f);
+    history /= 1.f + CLAMP_HISTORY_FALLOFF * clamp_amount;
+
+    moments = vec4(accumulate_moment(texelFetch(old_moments, old_pixel, 0).r, new_color, history));
+    return accumulate(vec4(clamped, old_color.a), new_color, history);
+}
 
-uniform int rendered_frames_count;
-uniform int fraction_pixel_per_frame;
-uniform uint time;
 void main() {
 
-    vec4 old_color = texture(old_texture, uv);
-    vec4 new_color = texture(new_texture, uv);
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec4 old_color = texelFetch(old_texture, pixel, 0);
+    float old_moment = texelFetch(old_moments, pixel, 0).r;
 
-    if (((uint(gl_FragCoord.y) + time) % fraction_pixel_per_frame) != 0)
+    // pixels the ray pass skipped keep everything they had
+    if (!pixel_traced(pixel, pixel_converged(old_color, old_moment)))
     {
         FragColor = old_color;
+        surface = texelFetch(old_surface, pixel, 0);
+        moments = vec4(old_moment);
         return;
     }
 
-    float frame_counter = float((rendered_frames_count-1) / fraction_pixel_per_frame+1);
+    vec3 new_color = texelFetch(new_texture, pixel, 0).rgb;
+    surface = texelFetch(new_surface, pixel, 0);
 
-    float weight = 1.f / float(frame_counter);
+    if (temporal_reprojection != 0 && camera_moved())
+    {
+        FragColor = reproject_and_accumulate(pixel, new_color, surface.xy);
+        return;
+    }
 
-    FragColor = old_color * (1 - weight) + new_color * weight;
+    float history = accumulated_frames(old_color);
+    FragColor = accumulate(old_color, new_color, history);
+    moments = vec4(accumulate_moment(old_moment, new_color, history));
 }
-
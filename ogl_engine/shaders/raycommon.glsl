@@ -0,0 +1,907 @@
+// scene buffers, traversal and shading shared by the fragment and the compute ray pass.
+// included after #version and the stage's own declarations, see ReadShaderSource in shader.cpp
+
+#define WIDE_BVH_INNER_NODE 255u
+// same as in bvh.h, which warns when a tree needs more
+#define BVH_STACK_SIZE 48
+// how the triangles of a mesh are stored, same values as in bvh.h
+#define GEOMETRY_FLOAT 0
+#define GEOMETRY_QUANTIZED_16 1
+#define GEOMETRY_QUANTIZED_32 2
+// STACKLESS_TRAVERSAL is defined by the host to walk the bvhs with parent links instead of a per ray stack
+
+// specialized variants get these fixed by the host, see rayShaderVariantDefines in main.cpp,
+// so loops over them can be unrolled and empty object kinds drop out. the generic program reads FrameParams
+#ifdef VARIANT_BOUNCES
+#define BOUNCES VARIANT_BOUNCES
+#else
+#define BOUNCES bounces
+#endif
+#ifdef VARIANT_SAMPLES_PER_PIXEL
+#define SAMPLES_PER_PIXEL VARIANT_SAMPLES_PER_PIXEL
+#else
+#define SAMPLES_PER_PIXEL samples_per_pixel
+#endif
+// VARIANT_NO_SPHERES and VARIANT_NO_TRIMESHES are defined when the scene has none of them
+
+
+
+struct Material
+{
+    vec3 color;
+    vec3 emission_color;
+    float emission_strenght;
+    float reflection_multiplier;
+};
+
+// inner node: children are left_first and left_first + 1, count is 0
+// leaf: triangles left_first .. left_first + count - 1
+struct BVHNode
+{
+    float box_min[3];
+    int left_first;
+    float box_max[3];
+    int count;
+};
+
+// 4 wide node, child box i on an axis is origin + (byte i of child_min / child_max) * 2^exponent.
+// byte i of child_info is 0 for an empty slot, WIDE_BVH_INNER_NODE when children[i] is a node,
+// otherwise the triangle count of the leaf starting at children[i]. parent is parent node * 4 + slot, -1 for the root.
+// the top byte of exponents is the axis the children are sorted on
+struct WideBVHNode
+{
+    float origin[3];
+    uint exponents;
+    uint child_min[3];
+    uint child_max[3];
+    int children[4];
+    uint child_info;
+    int parent;
+};
+
+// where the object space geometry shared by every instance of a mesh lives in the pools,
+// its wide nodes already point at pool indices so traversal starts at first_node and never needs the offsets again
+// material id k > 0 of a triangle is material first_material + k - 1, 0 uses the material of the instance
+struct MeshInfo
+{
+    int first_triangle;
+    int triangle_count;
+    int first_node;
+    int node_count;
+    int first_material;
+
+    // quantized meshes: first_triangle and first_vertex are word offsets in quantized_geometry,
+    // leaves hold triangle numbers in the mesh and a vertex is origin + q * scale
+    int format;
+    int first_vertex;
+    float origin[3];
+    float scale[3];
+};
+
+struct Instance
+{
+    mat4 transform;
+    mat4 inverse_transform;
+
+    int mesh;
+    int material;
+};
+
+struct _Sphere
+{
+    float center[3];
+    float radius;
+
+    int material;
+};
+
+struct _Material
+{
+    float color[3];
+    float emission[4];
+    float reflection;
+};
+
+layout(std430, binding = 0) buffer meshBuffer 
+{
+    MeshInfo meshes[];
+};
+
+layout(std430, binding = 1) buffer sphereBuffer
+{
+    _Sphere sphere_array[];
+};
+
+// top level bvh over all spheres and trimeshes, every leaf holds one object:
+// left_first >= 0 is sphere left_first, otherwise it's trimesh ~left_first
+layout(std430, binding = 2) buffer tlasBuffer
+{
+    BVHNode tlas_nodes[];
+};
+
+layout(std430, binding = 3) buffer instanceBuffer
+{
+    Instance instance_array[];
+};
+
+// parent of every top level node, -1 for the root
+layout(std430, binding = 4) buffer tlasParentBuffer
+{
+    int tlas_parents[];
+};
+
+// triangles of all meshes in bvh leaf order, triangle i is three vec4s:
+// the first vertex with the packed normal in w, then both edges, the first with the material id in w
+layout(std430, binding = 5) buffer trianglePoolBuffer
+{
+    vec4 triangles[];
+};
+
+layout(std430, binding = 6) buffer nodePoolBuffer
+{
+    WideBVHNode mesh_nodes[];
+};
+
+// every material in the scene, only read at the closest hit of a ray
+layout(std430, binding = 7) buffer materialBuffer
+{
+    _Material materials[];
+};
+
+// vertices and triangles of quantized meshes, see build_quantized_geometry in bvh.h
+layout(std430, binding = 8) buffer quantizedGeometryBuffer
+{
+    uint quantized_geometry[];
+};
+
+#define OCCUPANCY_MAX_BOUNCES 16
+// lanes per bounce for the occupancy stats in main.cpp: active lanes carry a path at that bounce,
+// resident lanes belong to a subgroup or work group that is still running it
+layout(std430, binding = 9) buffer occupancyBuffer
+{
+    uint active_lanes[OCCUPANCY_MAX_BOUNCES];
+    uint resident_lanes[OCCUPANCY_MAX_BOUNCES];
+};
+
+// pixels the ray pass found converged this frame, for the readout in main.cpp
+layout(std430, binding = 15) buffer convergenceBuffer
+{
+    uint converged_pixels;
+};
+
+// accumulated color and mean squared luminance before this frame, the ones the second pass blends into.
+// passes that write the accumulated image themselves load it through their images instead
+layout(binding = 4) uniform sampler2D accumulated_color;
+layout(binding = 5) uniform sampler2D accumulated_moments;
+
+
+#include "frameparams.glsl"
+
+
+float random(inout uint seed)
+{
+    seed ^= 2747636419u;
+    seed *= 2654435769u;
+    seed ^= seed >> 16;
+    seed *= 2654435769u;
+    seed ^= seed >> 16;
+    seed *= 2654435769u;
+
+    return float(seed) / 4294967295.0;
+}
+
+float random_normal_distribution(inout uint seed)
+{
+    float theta = 2 * 3.1415926 * random(seed);
+    float rho = sqrt(-2 * log(random(seed)));
+    return rho * cos(theta);
+}
+
+vec3 random_dir(inout uint seed)
+{
+
+  
+    float x = random_normal_distribution(seed);
+    float y = random_normal_distribution(seed);
+    float z = random_normal_distribution(seed);
+
+
+    return normalize(vec3(x, y, z));
+
+}
+
+vec3 random_hemisphere_dir(vec3 normal, inout uint seed)
+{
+    vec3 dir = random_dir(seed);
+    return dir * sign(dot(normal, dir));
+}
+
+struct Ray
+{
+    vec3 origin;
+    vec3 dir;
+
+};
+
+
+
+struct HitInfo
+{
+    vec3 p;
+    vec3 normal;
+    float t;
+
+    bool front_face;
+
+    // index in materials
+    int material;
+
+    // tlas leaf of the object, left_first of the leaf: a sphere index or ~trimesh index
+    int object;
+};
+
+struct Sphere
+{
+    vec3 center;
+    float radius;
+
+};
+
+vec3 at(Ray r, float t)
+{
+    return r.origin + t * r.dir;
+}
+
+bool hit_sphere(Sphere sphere, Ray r, float t_min, float t_max, inout HitInfo hit_info)
+{
+    vec3 oc = r.origin - sphere.center;
+    float dir_len = length(r.dir);
+    float a = dir_len * dir_len;
+    float half_b = dot(oc, r.dir);
+    
+    float oc_len = length(oc);
+    float c = oc_len * oc_len - sphere.radius * sphere.radius;
+
+    float discriminant = half_b  * half_b - a * c;
+    if (discriminant < 0.f)
+    {
+        return false;
+    }
+    float sqrtd = sqrt(discriminant);
+
+    float root = (-half_b - sqrtd) / a;
+
+    if (root < t_min || t_max < root)
+    {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+        {
+            return false;
+        }
+    }
+
+    hit_info.t = root;
+    hit_info.p = at(r, hit_info.t);
+    hit_info.normal = (hit_info.p - sphere.center) / sphere.radius;
+    if (dot(r.dir, hit_info.normal) > 0.f)
+    {
+        hit_info.normal *= -1.f;
+        hit_info.front_face = false;
+    }
+    else
+    {
+        hit_info.front_face = true;
+    }
+    return true;
+}
+
+// moller trumbore, updates closest on a hit
+bool intersect_triangle(vec3 v0, vec3 edge1, vec3 edge2, Ray r, inout float closest)
+{
+    const float epsilon = 0.001;
+    // det is the volume spanned by the edges and the direction, which shrinks with the cube of an instance's
+    // scale in object space, so the parallel test is relative to their lengths
+    const float parallel_epsilon = 1e-6;
+
+    vec3 ray_cross_e2 = cross(r.dir, edge2);
+    float det = dot(edge1, ray_cross_e2);
+
+    if (abs(det) < parallel_epsilon * length(edge1) * length(edge2) * length(r.dir))
+        return false;
+
+    float inv_det = 1.0 / det;
+    vec3 s = r.origin - v0;
+    float u = inv_det * dot(s, ray_cross_e2);
+
+    if (u < 0 || u > 1)
+        return false;
+
+    vec3 s_cross_e1 = cross(s, edge1);
+    float v = inv_det * dot(r.dir, s_cross_e1);
+
+    if (v < 0 || u + v > 1)
+        return false;
+
+    float t = inv_det * dot(edge2, s_cross_e1);
+
+    if (t <= epsilon || closest < t)
+        return false;
+
+    closest = t;
+    return true;
+}
+
+// triangle i from its precomputed record
+bool hit_triangle(int i, Ray r, inout float closest)
+{
+    return intersect_triangle(triangles[i * 3].xyz, triangles[i * 3 + 1].xyz, triangles[i * 3 + 2].xyz, r, closest);
+}
+
+// storage of the mesh that is traversed, read once per instance
+struct Geometry
+{
+    int format;
+    int first_vertex;
+    int first_triangle;
+    vec3 origin;
+    vec3 scale;
+};
+
+Geometry load_geometry(int m)
+{
+    vec3 origin = vec3(meshes[m].origin[0], meshes[m].origin[1], meshes[m].origin[2]);
+    vec3 scale = vec3(meshes[m].scale[0], meshes[m].scale[1], meshes[m].scale[2]);
+    return Geometry(meshes[m].format, meshes[m].first_vertex, meshes[m].first_triangle, origin, scale);
+}
+
+// q * scale is exact, so this is the same float the bvh was built from on the cpu
+vec3 quantized_vertex(Geometry g, uint v)
+{
+    uint xy = quantized_geometry[g.first_vertex + int(v) * 2];
+    uint z = quantized_geometry[g.first_vertex + int(v) * 2 + 1];
+    return g.origin + vec3(xy & 0xFFFFu, xy >> 16, z) * g.scale;
+}
+
+// vertex indices and material id of triangle i of a quantized mesh
+uvec4 quantized_triangle(Geometry g, int i)
+{
+    if (g.format == GEOMETRY_QUANTIZED_16)
+    {
+        uint a = quantized_geometry[g.first_triangle + i * 2];
+        uint b = quantized_geometry[g.first_triangle + i * 2 + 1];
+        return uvec4(a & 0xFFFFu, a >> 16, b & 0xFFFFu, b >> 16);
+    }
+    int w = g.first_triangle + i * 4;
+    return uvec4(quantized_geometry[w], quantized_geometry[w + 1], quantized_geometry[w + 2], quantized_geometry[w + 3]);
+}
+
+bool hit_quantized_triangle(Geometry g, int i, Ray r, inout float closest)
+{
+    uvec4 triangle = quantized_triangle(g, i);
+    vec3 v0 = quantized_vertex(g, triangle.x);
+    return intersect_triangle(v0, quantized_vertex(g, triangle.y) - v0, quantized_vertex(g, triangle.z) - v0, r, closest);
+}
+
+// inverse of pack_normal in bvh.h
+vec3 unpack_normal(uint packed)
+{
+    vec2 f = unpackSnorm2x16(packed);
+    vec3 n = vec3(f, 1.f - abs(f.x) - abs(f.y));
+    float t = max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return normalize(n);
+}
+
+// returns the distance to the node box or infinity when the ray misses it before t_max
+float hit_box(vec3 box_min, vec3 box_max, Ray r, vec3 inv_dir, float t_max)
+{
+    vec3 t1 = (box_min - r.origin) * inv_dir;
+    vec3 t2 = (box_max - r.origin) * inv_dir;
+
+    vec3 tmin = min(t1, t2);
+    vec3 tmax = max(t1, t2);
+
+    float near = max(max(tmin.x, tmin.y), tmin.z);
+    float far = min(min(tmax.x, tmax.y), tmax.z);
+
+    if (near > far || far < 0 || near > t_max)
+    {
+        return 1.f / 0.f;
+    }
+    return near;
+}
+
+float hit_bvh_node(BVHNode node, Ray r, vec3 inv_dir, float t_max)
+{
+    vec3 box_min = vec3(node.box_min[0], node.box_min[1], node.box_min[2]);
+    vec3 box_max = vec3(node.box_max[0], node.box_max[1], node.box_max[2]);
+    return hit_box(box_min, box_max, r, inv_dir, t_max);
+}
+
+// tests triangles first .. first + count - 1, hit_triangle is set to the closest one that was hit
+bool hit_leaf(Geometry g, int first, int count, Ray object_ray, inout float closest, inout int hit_triangle_index)
+{
+    bool hit = false;
+    for (int i = first; i < first + count; i++)
+    {
+        if (g.format == GEOMETRY_FLOAT ? hit_triangle(i, object_ray, closest) : hit_quantized_triangle(g, i, object_ray, closest))
+        {
+            hit = true;
+            hit_triangle_index = i;
+        }
+    }
+    return hit;
+}
+
+// distance to the box of child slot of a wide node, infinity when it's missed or empty
+float hit_wide_child(int node, int slot, Ray r, vec3 inv_dir, float t_max)
+{
+    uint shift = uint(slot) * 8u;
+
+    vec3 origin = vec3(mesh_nodes[node].origin[0], mesh_nodes[node].origin[1], mesh_nodes[node].origin[2]);
+    uvec3 exponents = (uvec3(mesh_nodes[node].exponents) >> uvec3(0, 8, 16)) & 0xFFu;
+    vec3 scale = uintBitsToFloat(exponents << 23);
+
+    uvec3 q_min = (uvec3(mesh_nodes[node].child_min[0], mesh_nodes[node].child_min[1], mesh_nodes[node].child_min[2]) >> shift) & 0xFFu;
+    uvec3 q_max = (uvec3(mesh_nodes[node].child_max[0], mesh_nodes[node].child_max[1], mesh_nodes[node].child_max[2]) >> shift) & 0xFFu;
+
+    return hit_box(origin + vec3(q_min) * scale, origin + vec3(q_max) * scale, r, inv_dir, t_max);
+}
+
+// children fill the slots from the start
+int wide_child_count(int node)
+{
+    uint info = mesh_nodes[node].child_info;
+    return int(info != 0u) + int((info & 0xFFFFFF00u) != 0u) + int((info & 0xFFFF0000u) != 0u) + int((info & 0xFF000000u) != 0u);
+}
+
+// 1 when the ray goes along the axis the children of the node are sorted on, -1 against it
+int wide_child_step(int node, Ray r)
+{
+    int axis = int(mesh_nodes[node].exponents >> 24);
+    return r.dir[axis] < 0.f ? -1 : 1;
+}
+
+// intersects instance o by moving the ray into the object space of its mesh,
+// t stays the same because the direction isn't normalized
+bool hit_trimesh(int o, Ray r, inout float closest, inout HitInfo hit_info)
+{
+    int m = instance_array[o].mesh;
+    mat4 inverse_transform = instance_array[o].inverse_transform;
+
+    if (meshes[m].triangle_count == 0)
+    {
+        return false;
+    }
+
+    Ray object_ray = Ray((inverse_transform * vec4(r.origin, 1.f)).xyz, (inverse_transform * vec4(r.dir, 0.f)).xyz);
+    vec3 inv_dir = 1.f / object_ray.dir;
+
+    Geometry g = load_geometry(m);
+    bool hit = false;
+    int hit_triangle_index = 0;
+
+#ifdef STACKLESS_TRAVERSAL
+    // depth first without a stack: the slots of a node are walked along its sort axis in the ray's direction,
+    // a finished node continues at the next slot of its parent
+    int node = meshes[m].first_node;
+    int step = wide_child_step(node, object_ray);
+    int slot = step > 0 ? 0 : wide_child_count(node) - 1;
+
+    while (true)
+    {
+        if (slot < 0 || slot >= wide_child_count(node))
+        {
+            int parent = mesh_nodes[node].parent;
+            if (parent < 0)
+                break;
+            node = parent >> 2;
+            step = wide_child_step(node, object_ray);
+            slot = (parent & 3) + step;
+            continue;
+        }
+
+        if (!isinf(hit_wide_child(node, slot, object_ray, inv_dir, closest)))
+        {
+            uint info = (mesh_nodes[node].child_info >> (uint(slot) * 8u)) & 0xFFu;
+            int child = mesh_nodes[node].children[slot];
+            if (info == WIDE_BVH_INNER_NODE)
+            {
+                node = child;
+                step = wide_child_step(node, object_ray);
+                slot = step > 0 ? 0 : wide_child_count(node) - 1;
+                continue;
+            }
+
+            if (hit_leaf(g, child, int(info), object_ray, closest, hit_triangle_index))
+                hit = true;
+        }
+        slot += step;
+    }
+#else
+    int stack[BVH_STACK_SIZE];
+    int stack_ptr = 0;
+    int node = meshes[m].first_node;
+
+    while (true)
+    {
+        WideBVHNode wide_node = mesh_nodes[node];
+
+        vec3 origin = vec3(wide_node.origin[0], wide_node.origin[1], wide_node.origin[2]);
+        uvec3 exponents = (uvec3(wide_node.exponents) >> uvec3(0, 8, 16)) & 0xFFu;
+        vec3 scale = uintBitsToFloat(exponents << 23);
+
+        // children that the ray hits, sorted front to back
+        float child_t[4];
+        int child_slot[4];
+        int hit_count = 0;
+
+        for (int i = 0; i < 4; i++)
+        {
+            uint shift = uint(i) * 8u;
+            if (((wide_node.child_info >> shift) & 0xFFu) == 0u)
+                continue;
+
+            uvec3 q_min = (uvec3(wide_node.child_min[0], wide_node.child_min[1], wide_node.child_min[2]) >> shift) & 0xFFu;
+            uvec3 q_max = (uvec3(wide_node.child_max[0], wide_node.child_max[1], wide_node.child_max[2]) >> shift) & 0xFFu;
+
+            float t = hit_box(origin + vec3(q_min) * scale, origin + vec3(q_max) * scale, object_ray, inv_dir, closest);
+            if (isinf(t))
+                continue;
+
+            int j = hit_count++;
+            while (j > 0 && child_t[j - 1] > t)
+            {
+                child_t[j] = child_t[j - 1];
+                child_slot[j] = child_slot[j - 1];
+                j--;
+            }
+            child_t[j] = t;
+            child_slot[j] = i;
+        }
+
+        // leaves are intersected right away, inner nodes are pushed far to near so the nearest is popped first
+        for (int k = 0; k < hit_count; k++)
+        {
+            int slot = child_slot[k];
+            uint info = (wide_node.child_info >> (uint(slot) * 8u)) & 0xFFu;
+            if (info == WIDE_BVH_INNER_NODE)
+                continue;
+
+            if (hit_leaf(g, wide_node.children[slot], int(info), object_ray, closest, hit_triangle_index))
+                hit = true;
+        }
+
+        for (int k = hit_count - 1; k >= 0; k--)
+        {
+            int slot = child_slot[k];
+            uint info = (wide_node.child_info >> (uint(slot) * 8u)) & 0xFFu;
+            if (info == WIDE_BVH_INNER_NODE && stack_ptr < BVH_STACK_SIZE)
+            {
+                stack[stack_ptr++] = wide_node.children[slot];
+            }
+        }
+
+        if (stack_ptr == 0)
+            break;
+        node = stack[--stack_ptr];
+    }
+#endif
+
+    if (hit)
+    {
+        // material and normal are only needed for the closest triangle
+        uint material_id;
+        vec3 normal;
+        if (g.format == GEOMETRY_FLOAT)
+        {
+            material_id = floatBitsToUint(triangles[hit_triangle_index * 3 + 1].w);
+            normal = unpack_normal(floatBitsToUint(triangles[hit_triangle_index * 3].w));
+        }
+        else
+        {
+            uvec4 triangle = quantized_triangle(g, hit_triangle_index);
+            vec3 v0 = quantized_vertex(g, triangle.x);
+            material_id = triangle.w;
+            normal = normalize(cross(quantized_vertex(g, triangle.y) - v0, quantized_vertex(g, triangle.z) - v0));
+        }
+
+        hit_info.t = closest;
+        hit_info.material = material_id == 0u ? instance_array[o].material : meshes[m].first_material + int(material_id) - 1;
+        hit_info.p = at(r, closest);
+
+        // normals go back to world space with the inverse transpose, the facing side doesn't change
+        hit_info.normal = normalize(transpose(mat3(inverse_transform)) * normal);
+        hit_info.front_face = dot(r.dir, hit_info.normal) <= 0.f;
+        if (!hit_info.front_face)
+            hit_info.normal *= -1.f;
+    }
+
+    return hit;
+}
+
+bool hit_sphere_object(int i, Ray r, inout float closest, inout HitInfo hit_info)
+{
+    vec3 center = vec3(sphere_array[i].center[0], sphere_array[i].center[1], sphere_array[i].center[2]);
+    float radius = sphere_array[i].radius;
+    Sphere sphere = Sphere(center, radius);
+    if (hit_sphere(sphere, r, 0, closest, hit_info))
+    {
+        closest = hit_info.t;
+        hit_info.material = sphere_array[i].material;
+        return true;
+    }
+    return false;
+}
+
+Material load_material(int i)
+{
+    vec3 color = vec3(materials[i].color[0], materials[i].color[1], materials[i].color[2]);
+    vec4 emission = vec4(materials[i].emission[0], materials[i].emission[1], materials[i].emission[2], materials[i].emission[3]);
+    return Material(color, emission.rgb, emission.w, materials[i].reflection);
+}
+
+bool cast_ray(Ray r, inout HitInfo hit_info)
+{
+
+    float closest = 1.f / 0.f;
+    bool hit = false;
+
+    vec3 inv_dir = 1.f / r.dir;
+
+    if (sphere_count + trimesh_count == 0 || isinf(hit_bvh_node(tlas_nodes[0], r, inv_dir, closest)))
+    {
+        return false;
+    }
+
+#ifdef STACKLESS_TRAVERSAL
+    // children are pairs starting at an odd index, so an odd node is a left child whose sibling is node + 1.
+    // after a node is done, climb while on a right child and continue at the next right sibling
+    int node = 0;
+
+    while (node != -1)
+    {
+        int count = tlas_nodes[node].count;
+        int left_first = tlas_nodes[node].left_first;
+
+        if (node == 0 || !isinf(hit_bvh_node(tlas_nodes[node], r, inv_dir, closest)))
+        {
+            if (count == 0)
+            {
+                node = left_first;
+                continue;
+            }
+
+            if (left_first >= 0)
+            {
+#ifndef VARIANT_NO_SPHERES
+                if (hit_sphere_object(left_first, r, closest, hit_info))
+                {
+                    hit = true;
+                    hit_info.object = left_first;
+                }
+#endif
+            }
+#ifndef VARIANT_NO_TRIMESHES
+            else if (hit_trimesh(~left_first, r, closest, hit_info))
+            {
+                hit = true;
+                hit_info.object = left_first;
+            }
+#endif
+        }
+
+        while (node != 0 && (node & 1) == 0)
+            node = tlas_parents[node];
+        node = node == 0 ? -1 : node + 1;
+    }
+#else
+    int stack[BVH_STACK_SIZE];
+    int stack_ptr = 0;
+    int node = 0;
+
+    while (true)
+    {
+        int count = tlas_nodes[node].count;
+        int left_first = tlas_nodes[node].left_first;
+
+        if (count > 0)
+        {
+            if (left_first >= 0)
+            {
+#ifndef VARIANT_NO_SPHERES
+                if (hit_sphere_object(left_first, r, closest, hit_info))
+                {
+                    hit = true;
+                    hit_info.object = left_first;
+                }
+#endif
+            }
+#ifndef VARIANT_NO_TRIMESHES
+            else if (hit_trimesh(~left_first, r, closest, hit_info))
+            {
+                hit = true;
+                hit_info.object = left_first;
+            }
+#endif
+
+            if (stack_ptr == 0)
+                break;
+            node = stack[--stack_ptr];
+            continue;
+        }
+
+        float t_left = hit_bvh_node(tlas_nodes[left_first], r, inv_dir, closest);
+        float t_right = hit_bvh_node(tlas_nodes[left_first + 1], r, inv_dir, closest);
+
+        int near_child = left_first;
+        int far_child = left_first + 1;
+        if (t_right < t_left)
+        {
+            float t = t_left; t_left = t_right; t_right = t;
+            near_child = left_first + 1;
+            far_child = left_first;
+        }
+
+        if (isinf(t_left))
+        {
+            if (stack_ptr == 0)
+                break;
+            node = stack[--stack_ptr];
+            continue;
+        }
+
+        node = near_child;
+        if (!isinf(t_right) && stack_ptr < BVH_STACK_SIZE)
+        {
+            stack[stack_ptr++] = far_child;
+        }
+    }
+#endif
+
+    return hit;
+}
+
+vec3 get_environment_light(Ray ray)
+{
+    //vec3 skyblue =    vec3(0.529f, 0.808f, 0.922f);
+    //vec3 horisontti = vec3(.8f, .8f, .8f);         
+    
+
+    float gradient = pow(smoothstep(0.0, 0.4, -ray.dir.y), 0.35f);
+
+    return mix(sky_color, horizont_color, gradient);
+}
+
+// OCCUPANCY_STATS is defined by the host together with GL_KHR_shader_subgroup_ballot.
+// a subgroup of the megakernel keeps all of its lanes until its longest path is done
+#ifdef OCCUPANCY_STATS
+void count_occupancy(int bounce)
+{
+    uint active = subgroupBallotBitCount(subgroupBallot(true));
+    if (subgroupElect() && bounce < OCCUPANCY_MAX_BOUNCES)
+    {
+        atomicAdd(active_lanes[bounce], active);
+        atomicAdd(resident_lanes[bounce], gl_SubgroupSize);
+    }
+}
+#endif
+
+// continues a path that hit a surface at p, mixing a diffuse and a mirror direction by the material
+Ray scatter_ray(Ray ray, vec3 p, vec3 normal, Material material, inout uint seed)
+{
+    ray.origin = p + normal * 0.0001f;
+    vec3 refraction = random_hemisphere_dir(normal, seed); // refraction
+    vec3 reflection = ray.dir - 2 * (dot(ray.dir, normal)) * normal; // reflection 
+    ray.dir = mix(refraction, reflection, material.reflection_multiplier);
+    return ray;
+}
+
+// distance to the hit of the unjittered ray through the pixel, 0 for the sky, and the object that was hit,
+// set by trace_primary_surface for the surface outputs of the ray passes
+vec2 primary_surface = vec2(0);
+// normal and material color at that hit for the denoiser, no normal and white for the sky
+vec3 primary_normal = vec3(0);
+vec3 primary_albedo = vec3(1);
+
+vec3 ray_color(Ray r, int max_bounce_count, inout uint seed)
+{
+    HitInfo hit_info;
+    Ray ray = r;
+    float multiplier = 1.f;
+    
+    vec3 incoming_light = vec3(0);
+    vec3 ray_color = vec3(1);
+    
+    for (int i = 0; i < max_bounce_count+1; i++)
+    {
+#ifdef OCCUPANCY_STATS
+        count_occupancy(i);
+#endif
+        HitInfo hit_info;
+        bool hit = cast_ray(ray, hit_info);
+        if (hit)
+        {
+            Material material = load_material(hit_info.material);
+            ray = scatter_ray(ray, hit_info.p, hit_info.normal, material, seed);
+            vec3 emitted_light = material.emission_color * material.emission_strenght;
+
+            incoming_light += emitted_light * ray_color;
+            ray_color *= material.color;
+        }
+        else
+        {
+            incoming_light += ray_color * get_environment_light(ray) * (1.f / float(pow(2, i)));
+            break;
+        }
+    }
+    return incoming_light;
+}
+
+
+// linear average of the samples, gamma and clamping are left to the tonemap pass so accumulation stays linear
+vec3 calculate_pixel_color(vec3 pixel_color, float samples_per_pixel)
+{
+    float scale = 1.f / samples_per_pixel;
+    return scale * pixel_color;
+}
+
+// adaptive sampling, false when pixel has converged and isn't revisited this frame. count adds converged pixels
+// to converged_pixels, passes that ask more than once a frame count only once
+bool trace_pixel(ivec2 pixel, vec4 accumulated, float moment, bool count)
+{
+    bool converged = pixel_converged(accumulated, moment);
+    if (converged && count)
+    {
+        atomicAdd(converged_pixels, 1u);
+    }
+    return pixel_traced(pixel, converged);
+}
+
+bool trace_pixel(ivec2 pixel, bool count)
+{
+    return trace_pixel(pixel, texelFetch(accumulated_color, pixel, 0), texelFetch(accumulated_moments, pixel, 0).r, count);
+}
+
+// the samples hit different points of the pixel, so the surface the second pass reprojects is traced separately
+// along the ray it rebuilds from the pixel. the denoiser guides come from the same ray, so they stay put from
+// frame to frame like the accumulated color they weight
+void trace_primary_surface(ivec2 pixel)
+{
+    Ray ray = Ray(camera, pixel_center_dir(pixel, camera_rotation, focal_length));
+    HitInfo hit_info;
+    bool hit = cast_ray(ray, hit_info);
+    primary_surface = hit ? vec2(hit_info.t * length(ray.dir), float(hit_info.object)) : vec2(0);
+    primary_normal = hit ? hit_info.normal : vec3(0);
+    primary_albedo = hit ? load_material(hit_info.material).color : vec3(1);
+}
+
+// ray through a random point of the pixel at frag_coord
+Ray camera_ray(vec2 frag_coord, inout uint seed)
+{
+    vec2 jitter;
+    jitter.x = random(seed);
+    jitter.y = random(seed);
+
+    return Ray(camera, camera_dir(screen_uv(frag_coord + jitter), camera_rotation, focal_length));
+}
+
+// color of the pixel whose center is at frag_coord, averaged over this frame's samples
+vec3 render_pixel(vec2 frag_coord)
+{
+    uint t = time;
+    random(t);
+    uint pixel_index = uint(frag_coord.y * resolution.x + frag_coord.x) + t;
+
+    vec3 pixel_color = vec3(0);
+
+    random(pixel_index);
+
+    for (int i = 0; i < SAMPLES_PER_PIXEL; i++)
+    {
+        Ray ray = camera_ray(frag_coord, pixel_index);
+        pixel_color += ray_color(ray, BOUNCES, pixel_index);
+    }
+    return calculate_pixel_color(pixel_color, SAMPLES_PER_PIXEL);
+}
@@ -0,0 +1,14 @@
+#version 330 core
+out vec4 FragColor;
+in vec4 color;
+in vec2 uv;
+
+// accumulated linear color
+uniform sampler2D tex;
+
+void main()
+{
+    // gamma 2, same curve the ray passes applied before accumulation was linear
+    vec3 linear_color = texture(tex, uv).rgb;
+    FragColor = vec4(clamp(sqrt(linear_color), 0.f, 1.f), 1.f);
+}
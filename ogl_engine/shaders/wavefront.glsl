@@ -0,0 +1,65 @@
+// ray and hit queues of the wavefront ray pass, see WavefrontTracer in rendering/wavefront.h.
+// every kernel handles one path per invocation, the queues are compacted by appending with atomic counters
+
+#define WAVEFRONT_GROUP_SIZE 64
+// WAVEFRONT_OCCUPANCY_STATS is defined by the host while the occupancy stats are shown, the schedule kernel
+// only counts lanes then
+
+#include "raycommon.glsl"
+
+struct PathState
+{
+    vec3 origin;
+    uint pixel;
+    vec3 dir;
+    uint seed;
+    vec3 throughput;
+    float padding;
+};
+
+// closest hit of the path with the same index, material is -1 for a miss
+struct PathHit
+{
+    vec3 p;
+    int material;
+    vec3 normal;
+    float t;
+};
+
+// paths of the current bounce
+layout(std430, binding = 10) buffer pathQueueIn
+{
+    PathState paths_in[];
+};
+
+// paths that continue to the next bounce
+layout(std430, binding = 11) buffer pathQueueOut
+{
+    PathState paths_out[];
+};
+
+layout(std430, binding = 12) buffer pathHitBuffer
+{
+    PathHit hits[];
+};
+
+// light gathered by the paths of each pixel over this frame's samples
+layout(std430, binding = 13) buffer radianceBuffer
+{
+    vec4 radiance[];
+};
+
+// dispatch arguments for the extend and shade kernels, then the queue counters
+layout(std430, binding = 14) buffer queueStateBuffer
+{
+    uint dispatch_x;
+    uint dispatch_y;
+    uint dispatch_z;
+    uint ray_count;
+    uint next_ray_count;
+};
+
+void push_path(PathState path)
+{
+    paths_out[atomicAdd(next_ray_count, 1u)] = path;
+}